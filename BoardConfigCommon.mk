@@ -62,9 +62,14 @@ BOARD_USE_MHEAP_SCREENSHOT := true
 # TARGET_FORCE_SCREENSHOT_CPU_PATH := true
 BOARD_HAVE_SAMSUNG_T20_HWCOMPOSER := true
 BOARD_TEGRA2_HWC_SET_RT_IOPRIO := false
+BOARD_TEGRA2_HWC_DC_OVERLAY := false
 TARGET_TEGRA2_HWC_1_1 := true
 # TARGET_USES_HWC2 := true
 
+# DispSync phase offsets: wake SurfaceFlinger 4 ms after the apps
+VSYNC_EVENT_PHASE_OFFSET_NS := 0
+SF_VSYNC_EVENT_PHASE_OFFSET_NS := 4000000
+
 TARGET_ICS_SENSOR_BLOB := true
 TARGET_HAS_LEGACY_CAMERA_HAL1 := true
 TARGET_NEEDS_NONPIE_CAMERASERVER := true
@@ -36,6 +36,14 @@ ifeq ($(BOARD_TEGRA2_HWC_SET_RT_IOPRIO),true)
 	LOCAL_CFLAGS += -DSET_RT_IOPRIO
 endif
 
+# YUV video layers on a DC window through tegra_dc_ext, bypassing the vendor module
+ifeq ($(BOARD_TEGRA2_HWC_DC_OVERLAY),true)
+	LOCAL_CFLAGS += -DTEGRA2_HWC_DC_OVERLAY
+ifneq ($(BOARD_TEGRA2_HWC_DC_OVERLAY_ID_INT),)
+	LOCAL_CFLAGS += -DTEGRA2_HWC_DC_OVERLAY_ID_INT=$(BOARD_TEGRA2_HWC_DC_OVERLAY_ID_INT)
+endif
+endif
+
 # Workaround for buggy Samsung Tegra 2 hwcomposer
 ifeq ($(BOARD_HAVE_SAMSUNG_T20_HWCOMPOSER),true)
 	LOCAL_CFLAGS += -DSAMSUNG_T20_HWCOMPOSER
@@ -47,3 +55,5 @@ LOCAL_CPP_INCLUDES += $(LOCAL_PATH)
 LOCAL_MODULE := hwcomposer.tegra
 LOCAL_MODULE_TAGS := optional
 include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
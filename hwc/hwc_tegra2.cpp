@@ -27,6 +27,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <dlfcn.h>
 #include <time.h>
 #if defined(__ANDROID__)
@@ -36,6 +37,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/resource.h>
 
 #include <cutils/compiler.h>
@@ -56,6 +58,7 @@
 #include <EGL/egl.h>
 
 #include "hwcomposer_v0.h"
+#include "hwc_xlate.h"
 
 #define likely(x)       __builtin_expect(!!(x), 1)
 #define unlikely(x)     __builtin_expect(!!(x), 0)
@@ -98,6 +101,92 @@ static hwc_module_t* get_hwc(void)
     return orghwc;
 }
 
+// Syncpoint VSYNC timestamps are fitted to a line over the last
+// VSYNC_MODEL_SAMPLES vblanks; samples further than VSYNC_OUTLIER_NS from
+// the fit are left out of it
+#define VSYNC_MODEL_SAMPLES         32
+#define VSYNC_MODEL_MIN_SAMPLES     8
+#define VSYNC_OUTLIER_NS            500000LL
+#define VSYNC_MAX_OUTLIERS          8   // in a row before the model restarts
+#define VSYNC_TRACE_SIZE            64  // raw/filtered history kept for dumpsys
+#define VSYNC_TRACE_DUMP            16
+
+struct vsync_model {
+    unsigned int count;
+    unsigned int head;
+    uint32_t    syncpt[VSYNC_MODEL_SAMPLES];
+    int64_t     ts_ns[VSYNC_MODEL_SAMPLES];
+
+    bool        valid;
+    uint32_t    base_syncpt;
+    int64_t     base_ns;
+    double      period_ns;
+    unsigned int outliers;              // consecutive
+    unsigned int rejected;              // total
+};
+
+// Written by the vsync thread only, read by dump() without locking: seq is
+// odd while an entry is being written
+struct vsync_trace_entry {
+    uint32_t    seq;
+    uint32_t    syncpt;
+    int64_t     raw_ns;
+    int64_t     filtered_ns;
+    int64_t     latency_ns;
+};
+
+// Overlay layers whose buffer is not ready this long before the next vsync
+// are composited by GLES for a while. Only the first ACQUIRE_MAX_LAYERS
+// layers are offered to the overlays, so all of them fit in the masks.
+#define ACQUIRE_DEADLINE_MARGIN_NS  2000000LL
+#define ACQUIRE_LATE_FRAMES         60
+#define ACQUIRE_MAX_LAYERS          32
+#define ACQUIRE_HIST_BUCKETS        7   // <0.5, <1, <2, <4, <8, <16, >=16 ms
+
+// Per-frame profiler, enabled with debug.hwc.profile=1
+#define PROFILE_FRAMES              256
+
+enum {
+    PROFILE_PREPARE_XLATE,
+    PROFILE_PREPARE,
+    PROFILE_ACQUIRE,
+    PROFILE_SET_XLATE,
+    PROFILE_SET,
+    PROFILE_RELEASE,
+    PROFILE_SINCE_VSYNC,
+    PROFILE_STAGES
+};
+
+struct frame_profile {
+    int64_t     start_ns;               // prepare() entry, 0 while not recording
+    uint16_t    layers;
+    uint16_t    overlays;
+    bool        cache_hit;
+    int32_t     stage_us[PROFILE_STAGES];
+};
+
+// Bits per pixel of a layer buffer as the overlay planner counts them
+#define PLANNER_FORMAT_CACHE        16
+
+struct planner_format {
+    buffer_handle_t handle;
+    uint32_t    bpp;
+};
+
+// YUV buffer as the DC window scans it out
+#define DC_OVERLAY_CACHE            8   // buffers of one video stream
+
+struct dc_overlay_buffer {
+    buffer_handle_t handle;
+    uint32_t    handle_id;              // id int of the handle when looked up
+    unsigned int seen;                  // dc_frame it was last in the list
+    uint32_t    id;                     // nvmap id, 0 if not usable
+    uint32_t    offset_u;
+    uint32_t    offset_v;
+    uint32_t    stride;
+    uint32_t    stride_uv;
+};
+
 struct tegra2_hwc_composer_device_1_t {
     hwc_composer_device_1_t base;
     hwc_composer_device_t* org;
@@ -123,7 +212,105 @@ struct tegra2_hwc_composer_device_1_t {
     void*       set_xlatebuf;
     int         set_xlatebufsz;
 
+    // Composition decisions of the last vendor prepare(), replayed while
+    // the geometry stays the same. They live in prepare_xlatebuf. Enabled
+    // with debug.hwc.prepare_cache=1.
+    bool        prepare_cache;
+    bool        prepare_cache_valid;
+    uint32_t    prepare_cache_hash;
+    unsigned int prepare_cache_hits;
+    unsigned int prepare_cache_misses;
+
+    // Software sync timeline backing the layer release fences. The vsync
+    // thread advances it to sync_release_value at the first vblank after
+    // sync_release_ns. Protected by vsync_mutex.
+    int         sync_timeline_fd;
+    unsigned int sync_timeline_value;
+    unsigned int sync_release_value;
+    int64_t     sync_release_ns;        // when the last set() returned
+
+    // Acquire fence wait stage
+    int64_t     last_vsync_ns;          // accessed atomically
+    uint32_t    late_layers;            // layers forced to GLES composition
+    unsigned int late_frames;           // frames left before retrying them
+    unsigned int acquire_hist[ACQUIRE_HIST_BUCKETS];
+    unsigned int acquire_missed;
+
+    // Emulated VSYNC phase-locked loop, for dumpsys
+    bool        vsync_emulated;
+    bool        pll_locked;
+    int64_t     pll_period_ns;
+    int64_t     pll_error_ns;
+    int64_t     pll_spread_ns;          // wakeup spread of the last reference
+
+    // Emulated VSYNC reference sampler, protected by vsync_mutex
+    pthread_t   ref_thread;
+    pthread_cond_t ref_cond;
+    bool        ref_running;
+    bool        ref_request;            // sample the next vblanks
+    bool        ref_ready;              // ref_ns holds a new reference
+    bool        ref_failed;             // no FBIO_WAITFORVSYNC, run open loop
+    int64_t     ref_ns;
+
+    // Syncpoint VSYNC timestamp model and its history
+    struct vsync_model vsync_model;
+    struct vsync_trace_entry vsync_trace[VSYNC_TRACE_SIZE];
+    unsigned int vsync_trace_count;
+
+    // Frame profiler: profile_cur is only touched from prepare()/set()
+    bool        profile;
+    struct frame_profile profile_cur;
+    struct frame_profile profile_ring[PROFILE_FRAMES];
+    unsigned int profile_count;
+    pthread_mutex_t profile_lock;
+
+    // Idle refresh: after idle_ms without new buffers fb0 runs at idle_hz.
+    // refresh_gen changes, under vsync_mutex, whenever the frame time does.
+    // Only the idle thread switches the mode, set() posts idle_wake.
+    int         idle_ms;
+    int         idle_hz;
+    bool        idle_active;
+    bool        idle_wake;
+    volatile bool idle_running;
+    uint32_t    idle_hash;
+    int64_t     idle_last_update_ns;
+    unsigned int idle_entries;
+    uint64_t    idle_frame_pixels;
+    uint32_t    idle_full_pixclock;
+    pthread_t   idle_thread;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    unsigned int refresh_gen;
+
+    // DC0 window for YUV video layers, bypassing the vendor module
+    int         dc_fd;
+    int         nvmap_fd;
+    int         dc_window;              // held only while a layer uses it, else -1
+    bool        dc_window_busy;         // none free, retry on a geometry change
+    int         dc_layer;               // layer claimed by prepare(), or -1
+    bool        dc_active;              // window is showing a buffer
+    bool        dc_flip_pending;        // last flip not latched, vsync_mutex
+    uint32_t    dc_post_syncpt_id;
+    uint32_t    dc_post_syncpt_val;
+    struct dc_overlay_buffer dc_buf;    // buffer of dc_layer
+    struct dc_overlay_buffer dc_cache[DC_OVERLAY_CACHE];
+    unsigned int dc_cache_next;
+    unsigned int dc_frame;
+    unsigned int dc_flips;
+
+    // Overlay planner, enabled with debug.hwc.planner=1
+    bool        planner;
+    uint32_t    planner_fetch_budget;   // DC fetch per output pixel, 1/16 bytes
+    uint32_t    planner_overlays;       // layers offered to the vendor module
+    unsigned int planner_runs;
+    uint64_t    planner_cost;           // bytes per frame, last plan
+    uint64_t    planner_gles_cost;      // same frame, all GLES
+    unsigned int planner_declined;      // plans the vendor module took none of
+    struct planner_format planner_formats[PLANNER_FORMAT_CACHE];
+    unsigned int planner_formats_next;
+
     // Misc info
+    const gralloc_module_t* gralloc;
     int         fb_fd;
     int32_t     xres;
     int32_t     yres;
@@ -134,73 +321,6 @@ struct tegra2_hwc_composer_device_1_t {
     volatile bool fbblanked;    // Framebuffer disabled
 };
 
-static void copy_display_contents_1_to_layer_list(hwc_layer_list_t* dst,hwc_display_contents_1_t* src)
-{
-    dst->flags = src->flags;
-    unsigned int s,d;
-
-    __asm__ volatile("vpush {d0}\n" : : );
-    for (s = 0, d = 0; s < src->numHwLayers; s++) {
-        void *src_buf = &src->hwLayers[s];
-        void *dst_buf = &dst->hwLayers[d++];
-        __asm__ volatile(
-            "pld [%0, #64]\n"
-            "pld [%0, #96]\n"
-            "vldr d0, [%0, #0x00]\n"
-            "vstr d0, [%1, #0x00]\n"
-            "vldr d0, [%0, #0x08]\n"
-            "vstr d0, [%1, #0x08]\n"
-            "vldr d0, [%0, #0x10]\n"
-            "vstr d0, [%1, #0x10]\n"
-            "vldr d0, [%0, #0x18]\n"
-            "vstr d0, [%1, #0x18]\n"
-            "vldr d0, [%0, #0x20]\n"
-            "vstr d0, [%1, #0x20]\n"
-            "vldr d0, [%0, #0x28]\n"
-            "vstr d0, [%1, #0x28]\n"
-            "vldr d0, [%0, #0x30]\n"
-            "vstr d0, [%1, #0x30]\n"
-            "vldr d0, [%0, #0x38]\n"
-            "vstr d0, [%1, #0x38]\n"
-            : : "r" (src_buf), "r" (dst_buf) : );
-    }
-    __asm__ volatile("vpop {d0}\n" : : );
-    dst->numHwLayers = d;
-}
-
-static void copy_layer_list_to_display_contents_1(hwc_display_contents_1_t* dst,hwc_layer_list_t* src)
-{
-    dst->flags = src->flags;
-    unsigned int s,d;
-
-    __asm__ volatile("vpush {d0}\n" : : );
-    for (s = 0, d = 0; d < dst->numHwLayers; d++) {
-        void *src_buf = &src->hwLayers[s++];
-        void *dst_buf = &dst->hwLayers[d];
-        __asm__ volatile(
-            "pld [%0, #64]\n"
-            "pld [%0, #96]\n"
-            "vldr d0, [%0, #0x00]\n"
-            "vstr d0, [%1, #0x00]\n"
-            "vldr d0, [%0, #0x08]\n"
-            "vstr d0, [%1, #0x08]\n"
-            "vldr d0, [%0, #0x10]\n"
-            "vstr d0, [%1, #0x10]\n"
-            "vldr d0, [%0, #0x18]\n"
-            "vstr d0, [%1, #0x18]\n"
-            "vldr d0, [%0, #0x20]\n"
-            "vstr d0, [%1, #0x20]\n"
-            "vldr d0, [%0, #0x28]\n"
-            "vstr d0, [%1, #0x28]\n"
-            "vldr d0, [%0, #0x30]\n"
-            "vstr d0, [%1, #0x30]\n"
-            "vldr d0, [%0, #0x38]\n"
-            "vstr d0, [%1, #0x38]\n"
-            : : "r" (src_buf), "r" (dst_buf) : );
-    }
-    __asm__ volatile("vpop {d0}\n" : : );
-}
-
 // Make sure we have enough space on the translation buffer
 static inline size_t ensure_xlatebuf(void** buf, size_t bufsz, size_t reqsz)
 {
@@ -214,20 +334,1042 @@ static inline size_t ensure_xlatebuf(void** buf, size_t bufsz, size_t reqsz)
             ALOGE("Failed to allocate buffer.");
             abort();
         }
+        return reqsz;
     }
 
-    return reqsz;
+    return bufsz;
 }
 
-static int tegra2_set(struct hwc_composer_device_1 *dev,
-        size_t numDisplays, hwc_display_contents_1_t** displays)
+#define FNV1A_SEED      2166136261U
+#define FNV1A_PRIME     16777619U
+
+static inline uint32_t fnv1a(uint32_t hash, const void* data, size_t len)
 {
-    if (!numDisplays || !displays)
+    const uint8_t* p = (const uint8_t*)data;
+    while (len--)
+        hash = (hash ^ *p++) * FNV1A_PRIME;
+    return hash;
+}
+
+// Hash everything the vendor composition decisions depend on, but not the
+// buffer handles, which change on every frame of an animation.
+static uint32_t planner_bpp(struct tegra2_hwc_composer_device_1_t *pdev,
+        buffer_handle_t handle);
+
+// The gralloc module only tells YUV from RGB buffers (see planner_bpp()),
+// so that stands in for the buffer format. Usage bits are private to the
+// Tegra gralloc handle and cannot be hashed, which is one reason the cache
+// is off by default.
+static uint32_t hash_geometry(struct tegra2_hwc_composer_device_1_t *pdev,
+        const hwc_display_contents_1_t* contents)
+{
+    uint32_t hash = fnv1a(FNV1A_SEED, &contents->numHwLayers, sizeof(contents->numHwLayers));
+
+    for (size_t i = 0; i < contents->numHwLayers; i++) {
+        const hwc_layer_1_t* l = &contents->hwLayers[i];
+
+        hash = fnv1a(hash, &l->compositionType, sizeof(l->compositionType));
+        hash = fnv1a(hash, &l->flags, sizeof(l->flags));
+        hash = fnv1a(hash, &l->transform, sizeof(l->transform));
+        hash = fnv1a(hash, &l->blending, sizeof(l->blending));
+        if (l->handle) {
+            uint32_t bpp = planner_bpp(pdev, l->handle);
+            hash = fnv1a(hash, &bpp, sizeof(bpp));
+        }
+        hash = fnv1a(hash, &l->sourceCrop, sizeof(l->sourceCrop));
+        hash = fnv1a(hash, &l->displayFrame, sizeof(l->displayFrame));
+        hash = fnv1a(hash, &l->visibleRegionScreen.numRects,
+                sizeof(l->visibleRegionScreen.numRects));
+        if (l->visibleRegionScreen.numRects)
+            hash = fnv1a(hash, l->visibleRegionScreen.rects,
+                    sizeof(hwc_rect_t) * l->visibleRegionScreen.numRects);
+    }
+
+    return hash;
+}
+
+/* -- Release fences on a software sync timeline */
+
+#include <linux/sw_sync.h> /* android sync driver headers from the linux kernel headers */
+
+static int sw_sync_timeline_open(void)
+{
+    int fd = open("/dev/sw_sync", O_RDWR);
+    if (fd < 0)
+        ALOGW("Unable to open /dev/sw_sync (%s), no release fences", strerror(errno));
+    return fd;
+}
+
+static int sw_sync_timeline_fence(int fd, unsigned int value)
+{
+    struct sw_sync_create_fence_data data;
+
+    memset(&data, 0, sizeof(data));
+    data.value = value;
+    snprintf(data.name, sizeof(data.name), "hwc_release_%u", value);
+    if (ioctl(fd, SW_SYNC_IOC_CREATE_FENCE, &data) < 0) {
+        ALOGE("Unable to create release fence: %s", strerror(errno));
+        return -1;
+    }
+
+    return data.fence;
+}
+
+// Signal every fence up to value. Called with vsync_mutex held.
+static void sw_sync_timeline_advance_to(tegra2_hwc_composer_device_1_t *pdev,
+        unsigned int value)
+{
+    if (pdev->sync_timeline_fd < 0 || (int)(value - pdev->sync_timeline_value) <= 0)
+        return;
+
+    __u32 count = value - pdev->sync_timeline_value;
+    if (ioctl(pdev->sync_timeline_fd, SW_SYNC_IOC_INC, &count) < 0)
+        ALOGE("Unable to advance release timeline: %s", strerror(errno));
+    pdev->sync_timeline_value = value;
+}
+
+static inline bool sw_sync_release_pending(tegra2_hwc_composer_device_1_t *pdev)
+{
+    return pdev->sync_timeline_fd >= 0 && pdev->sync_timeline_value != pdev->sync_release_value;
+}
+
+// The frame of the last set() is scanned out from the vblank at vblank_ns
+// on, so the buffers of the frames before it are free. The vendor flip is
+// only latched at a vblank, so one that came before set() returned does not
+// count. The DC window is flipped on its own queue; the vsync threads hold
+// this back until that flip has latched too. Called with vsync_mutex held.
+static void sw_sync_timeline_vblank(tegra2_hwc_composer_device_1_t *pdev, int64_t vblank_ns)
+{
+    if (sw_sync_release_pending(pdev) && vblank_ns > pdev->sync_release_ns)
+        sw_sync_timeline_advance_to(pdev, pdev->sync_release_value);
+}
+
+/* -- Acquire fence wait stage */
+
+static inline int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void record_acquire_latency(tegra2_hwc_composer_device_1_t *pdev, int64_t ns)
+{
+    int64_t limit_ns = 500000LL;
+    unsigned int bucket = 0;
+
+    while (bucket < ACQUIRE_HIST_BUCKETS - 1 && ns >= limit_ns) {
+        limit_ns <<= 1;
+        bucket++;
+    }
+    pdev->acquire_hist[bucket]++;
+}
+
+// Poll the acquire fences of all overlay layers together until shortly
+// before the next vsync. Layers still pending then are waited for up to one
+// more frame and returned as a mask of late layers. The ones that are still
+// not ready after that are also returned in *unready: the vendor module must
+// not scan out an unfinished buffer, so set() leaves them out of this frame.
+static uint32_t wait_acquire_fences(tegra2_hwc_composer_device_1_t *pdev,
+        hwc_display_contents_1_t *contents, uint32_t *unready)
+{
+    struct pollfd fds[ACQUIRE_MAX_LAYERS];
+    unsigned int layer[ACQUIRE_MAX_LAYERS];
+    unsigned int n = 0;
+
+    for (size_t i = 0; i < contents->numHwLayers && i < ACQUIRE_MAX_LAYERS; i++) {
+        hwc_layer_1_t *l = &contents->hwLayers[i];
+        if (l->compositionType != HWC_OVERLAY || l->acquireFenceFd < 0)
+            continue;
+        fds[n].fd = l->acquireFenceFd;
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        layer[n++] = i;
+    }
+    *unready = 0;
+    if (!n)
         return 0;
 
-    tegra2_hwc_composer_device_1_t *pdev = (tegra2_hwc_composer_device_1_t *)dev;
+    int64_t start = monotonic_ns();
+    int64_t period = pdev->time_between_frames_ns;
+    int64_t vsync = __atomic_load_n(&pdev->last_vsync_ns, __ATOMIC_RELAXED);
+    int64_t deadline;
+
+    if (vsync <= 0 || period <= 0)
+        deadline = start + period;
+    else
+        deadline = vsync + ((start - vsync) / period + 1) * period;
+    deadline -= ACQUIRE_DEADLINE_MARGIN_NS;
+    if (deadline <= start)
+        deadline += period;
+    int64_t give_up = deadline + period;
+
+    uint32_t late = 0;
+    unsigned int pending = n;
+    bool missed = false;
+
+    while (pending) {
+        int64_t now = monotonic_ns();
+        int timeout_ms;
+
+        if (!missed) {
+            if (now >= deadline) {
+                missed = true;
+                continue;
+            }
+            timeout_ms = (deadline - now + 999999LL) / 1000000LL;
+        } else {
+            if (now >= give_up)
+                break;
+            timeout_ms = (give_up - now + 999999LL) / 1000000LL;
+        }
+
+        int ret = poll(fds, n, timeout_ms);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("Failed to wait for acquire fences: %s", strerror(errno));
+            break;
+        }
+        if (ret == 0) {
+            missed = true;
+            continue;
+        }
+
+        now = monotonic_ns();
+        for (unsigned int i = 0; i < n; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents)
+                continue;
+            record_acquire_latency(pdev, now - start);
+            if (missed) {
+                late |= 1U << layer[i];
+                pdev->acquire_missed++;
+            }
+            // poll() skips negative descriptors
+            fds[i].fd = -1;
+            pending--;
+        }
+    }
+
+    for (unsigned int i = 0; pending && i < n; i++) {
+        if (fds[i].fd < 0)
+            continue;
+        *unready |= 1U << layer[i];
+        pdev->acquire_missed++;
+    }
+    if (*unready)
+        ALOGW("%u acquire fences not signaled a frame after the deadline", pending);
+
+    return late | *unready;
+}
+
+/* -- Per-frame profiler */
+
+static const char *profile_stage_names[PROFILE_STAGES] = {
+    "prepare xlate",
+    "vendor prepare",
+    "acquire wait",
+    "set xlate",
+    "vendor set",
+    "release fences",
+    "vsync to set",
+};
+
+// Close the current stage and start the next one
+static inline void profile_stage(tegra2_hwc_composer_device_1_t *pdev, int stage, int64_t *t)
+{
+    if (!pdev->profile || !pdev->profile_cur.start_ns)
+        return;
+
+    int64_t now = monotonic_ns();
+    pdev->profile_cur.stage_us[stage] = (now - *t) / 1000;
+    *t = now;
+}
+
+static void profile_count_overlays(tegra2_hwc_composer_device_1_t *pdev,
+        const hwc_display_contents_1_t *contents)
+{
+    if (!pdev->profile)
+        return;
+
+    unsigned int overlays = 0;
+    for (size_t i = 0; i < contents->numHwLayers; i++) {
+        if (contents->hwLayers[i].compositionType == HWC_OVERLAY)
+            overlays++;
+    }
+    pdev->profile_cur.overlays = overlays;
+}
+
+static void profile_commit(tegra2_hwc_composer_device_1_t *pdev)
+{
+    if (!pdev->profile || !pdev->profile_cur.start_ns)
+        return;
+
+    pthread_mutex_lock(&pdev->profile_lock);
+    pdev->profile_ring[pdev->profile_count % PROFILE_FRAMES] = pdev->profile_cur;
+    pdev->profile_count++;
+    pthread_mutex_unlock(&pdev->profile_lock);
+
+    pdev->profile_cur.start_ns = 0;
+}
+
+static int compare_int32(const void *a, const void *b)
+{
+    int32_t x = *(const int32_t *)a;
+    int32_t y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int profile_dump(tegra2_hwc_composer_device_1_t *pdev, char *buff, int buff_len)
+{
+    struct frame_profile *frames =
+        (struct frame_profile *)malloc(sizeof(*frames) * PROFILE_FRAMES);
+    int32_t values[PROFILE_FRAMES];
+    unsigned int n, hits = 0;
+    int len = 0;
+
+    if (!frames)
+        return 0;
+
+    pthread_mutex_lock(&pdev->profile_lock);
+    n = pdev->profile_count < PROFILE_FRAMES ? pdev->profile_count : PROFILE_FRAMES;
+    for (unsigned int i = 0; i < n; i++)
+        frames[i] = pdev->profile_ring[(pdev->profile_count - n + i) % PROFILE_FRAMES];
+    pthread_mutex_unlock(&pdev->profile_lock);
+
+    if (!n) {
+        free(frames);
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < n; i++)
+        hits += frames[i].cache_hit;
+
+    len += snprintf(buff + len, buff_len - len,
+        "  frame profile, last %u frames, %u prepare cache hits (us):\n"
+        "    %-16s %7s %7s %7s %7s\n", n, hits, "stage", "p50", "p90", "p99", "max");
+
+    for (int s = 0; s < PROFILE_STAGES && len < buff_len; s++) {
+        for (unsigned int i = 0; i < n; i++)
+            values[i] = frames[i].stage_us[s];
+        qsort(values, n, sizeof(values[0]), compare_int32);
+
+        len += snprintf(buff + len, buff_len - len,
+            "    %-16s %7d %7d %7d %7d\n", profile_stage_names[s],
+            values[n * 50 / 100], values[n * 90 / 100], values[n * 99 / 100], values[n - 1]);
+    }
+
+    // Full trace for offline analysis
+    char path[PROPERTY_VALUE_MAX];
+    property_get("debug.hwc.profile_trace", path, "");
+    if (path[0]) {
+        FILE *f = fopen(path, "w");
+        if (f) {
+            fprintf(f, "start_ns,layers,overlays,cache_hit");
+            for (int s = 0; s < PROFILE_STAGES; s++)
+                fprintf(f, ",%s_us", profile_stage_names[s]);
+            fprintf(f, "\n");
+            for (unsigned int i = 0; i < n; i++) {
+                fprintf(f, "%lld,%u,%u,%d", (long long) frames[i].start_ns,
+                    frames[i].layers, frames[i].overlays, frames[i].cache_hit);
+                for (int s = 0; s < PROFILE_STAGES; s++)
+                    fprintf(f, ",%d", frames[i].stage_us[s]);
+                fprintf(f, "\n");
+            }
+            fclose(f);
+        } else {
+            ALOGW("Unable to write profile trace to %s: %s", path, strerror(errno));
+        }
+    }
+
+    free(frames);
+    return len < buff_len ? len : buff_len;
+}
+
+/* -- Idle refresh: lower the panel refresh rate while nothing changes */
+
+static uint32_t hash_handles(const hwc_display_contents_1_t* contents)
+{
+    uint32_t hash = fnv1a(FNV1A_SEED, &contents->numHwLayers, sizeof(contents->numHwLayers));
+
+    for (size_t i = 0; i < contents->numHwLayers; i++)
+        hash = fnv1a(hash, &contents->hwLayers[i].handle, sizeof(buffer_handle_t));
+    return hash;
+}
+
+// Reprogram the fb0 pixel clock for the idle or the full refresh rate.
+// Called by the idle thread without idle_lock, the mode set can take a
+// frame or more.
+static int idle_set_refresh(struct tegra2_hwc_composer_device_1_t *pdev, bool idle)
+{
+    struct fb_var_screeninfo info;
+
+    if (ioctl(pdev->fb_fd, FBIOGET_VSCREENINFO, &info) < 0)
+        return -errno;
+
+    // Only the pixel clock changes, the pan offset gralloc set stays
+    info.pixclock = idle
+        ? (uint32_t)(1000000000000ULL / (pdev->idle_frame_pixels * pdev->idle_hz))
+        : pdev->idle_full_pixclock;
+    info.activate = FB_ACTIVATE_NOW;
+    if (ioctl(pdev->fb_fd, FBIOPUT_VSCREENINFO, &info) < 0 ||
+        ioctl(pdev->fb_fd, FBIOGET_VSCREENINFO, &info) < 0)
+        return -errno;
+
+    // The driver rounds to what the clock tree can do
+    unsigned long long frame_ns = pdev->idle_frame_pixels * info.pixclock / 1000ULL;
+
+    pthread_mutex_lock(&pdev->vsync_mutex);
+    pdev->time_between_frames_ns = frame_ns;
+    pdev->time_between_frames_us = (unsigned long)(frame_ns / 1000ULL);
+    pdev->refresh_gen++;
+    pthread_mutex_unlock(&pdev->vsync_mutex);
+
+    ALOGD("Refresh %s, %llu ns per frame", idle ? "lowered, screen is idle" : "back to full rate",
+        frame_ns);
+    return 0;
+}
+
+// The screen content changed: restart the idle timeout and have the idle
+// thread leave idle refresh
+static void idle_update(struct tegra2_hwc_composer_device_1_t *pdev)
+{
+    pthread_mutex_lock(&pdev->idle_lock);
+    pdev->idle_last_update_ns = monotonic_ns();
+    pdev->idle_wake = true;
+    pthread_cond_signal(&pdev->idle_cond);
+    pthread_mutex_unlock(&pdev->idle_lock);
+}
+
+static void *tegra2_hwc_idle_thread(void *data)
+{
+    struct tegra2_hwc_composer_device_1_t *pdev =
+            (struct tegra2_hwc_composer_device_1_t *) data;
+
+    pthread_mutex_lock(&pdev->idle_lock);
+    while (pdev->idle_running) {
+        if (pdev->idle_wake) {
+            pdev->idle_wake = false;
+            if (!pdev->idle_active)
+                continue;
+
+            pthread_mutex_unlock(&pdev->idle_lock);
+            int err = idle_set_refresh(pdev, false);
+            pthread_mutex_lock(&pdev->idle_lock);
+            if (err < 0)
+                ALOGE("Unable to restore the full refresh rate: %s", strerror(-err));
+            else
+                pdev->idle_active = false;
+            continue;
+        }
+        if (pdev->idle_active || pdev->fbblanked) {
+            pthread_cond_wait(&pdev->idle_cond, &pdev->idle_lock);
+            continue;
+        }
+
+        int64_t deadline = pdev->idle_last_update_ns + pdev->idle_ms * 1000000LL;
+        if (monotonic_ns() < deadline) {
+            struct timespec ts;
+            ts.tv_sec = deadline / 1000000000LL;
+            ts.tv_nsec = deadline % 1000000000LL;
+            pthread_cond_timedwait(&pdev->idle_cond, &pdev->idle_lock, &ts);
+            continue;
+        }
+
+        // A frame posted meanwhile sets idle_wake and undoes this
+        pthread_mutex_unlock(&pdev->idle_lock);
+        int err = idle_set_refresh(pdev, true);
+        pthread_mutex_lock(&pdev->idle_lock);
+        if (err < 0) {
+            ALOGE("Unable to lower the refresh rate (%s), idle refresh disabled",
+                strerror(-err));
+            break;
+        }
+        pdev->idle_active = true;
+        pdev->idle_entries++;
+    }
+    pthread_mutex_unlock(&pdev->idle_lock);
+
+    return NULL;
+}
+
+static void idle_init(struct tegra2_hwc_composer_device_1_t *dev)
+{
+    struct fb_var_screeninfo info;
+    char property[PROPERTY_VALUE_MAX];
+
+    property_get("debug.hwc.idle_ms", property, "0");
+    dev->idle_ms = atoi(property);
+    property_get("debug.hwc.idle_hz", property, "40");
+    dev->idle_hz = atoi(property);
+
+    if (dev->idle_ms <= 0 || dev->idle_hz <= 0 || dev->fb_fd < 0)
+        return;
+    if (ioctl(dev->fb_fd, FBIOGET_VSCREENINFO, &info) < 0 || !info.pixclock)
+        return;
+
+    dev->idle_frame_pixels =
+        uint64_t(info.upper_margin + info.lower_margin + info.vsync_len + info.yres)
+        * (info.left_margin + info.right_margin + info.hsync_len + info.xres);
+    dev->idle_full_pixclock = info.pixclock;
+    if (1000000000000ULL / (dev->idle_frame_pixels * info.pixclock) <= (uint64_t)dev->idle_hz) {
+        ALOGW("Idle refresh of %d Hz is not below the panel rate, not using it", dev->idle_hz);
+        return;
+    }
+
+    pthread_mutex_init(&dev->idle_lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&dev->idle_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    dev->idle_last_update_ns = monotonic_ns();
+    dev->idle_running = true;
+    if (pthread_create(&dev->idle_thread, NULL, tegra2_hwc_idle_thread, dev)) {
+        ALOGE("Unable to start idle refresh thread");
+        dev->idle_running = false;
+        pthread_cond_destroy(&dev->idle_cond);
+        pthread_mutex_destroy(&dev->idle_lock);
+        return;
+    }
+
+    ALOGI("Idle refresh: %d Hz after %d ms without updates", dev->idle_hz, dev->idle_ms);
+}
+
+static void idle_stop(struct tegra2_hwc_composer_device_1_t *pdev)
+{
+    if (!pdev->idle_running)
+        return;
+
+    pthread_mutex_lock(&pdev->idle_lock);
+    pdev->idle_running = false;
+    pthread_cond_signal(&pdev->idle_cond);
+    pthread_mutex_unlock(&pdev->idle_lock);
+    pthread_join(pdev->idle_thread, NULL);
+
+    if (pdev->idle_active) {
+        idle_set_refresh(pdev, false);
+        pdev->idle_active = false;
+    }
+
+    pthread_cond_destroy(&pdev->idle_cond);
+    pthread_mutex_destroy(&pdev->idle_lock);
+}
+
+/* -- YUV video layers flipped straight to a DC window */
+
+#ifdef TEGRA2_HWC_DC_OVERLAY
+
+#include <linux/nvhost_ioctl.h>
+#include <video/tegra_dc_ext.h>
+
+// Index of the nvmap buffer id among the ints of a gralloc buffer handle.
+// The NVIDIA gralloc handle layout is not public, check it on the device.
+#ifndef TEGRA2_HWC_DC_OVERLAY_ID_INT
+#define TEGRA2_HWC_DC_OVERLAY_ID_INT    0
+#endif
+
+#define DC_OVERLAY_MAX_DOWNSCALE        2
+
+static int dc_overlay_open(struct tegra2_hwc_composer_device_1_t *dev)
+{
+    dev->dc_window = -1;
+    dev->dc_layer = -1;
+
+    dev->dc_fd = open("/dev/tegra_dc0", O_RDWR);
+    if (dev->dc_fd < 0)
+        dev->dc_fd = open("/dev/tegra_dc_0", O_RDWR);
+    dev->nvmap_fd = open("/dev/nvmap", O_RDWR);
+    if (dev->dc_fd < 0 || dev->nvmap_fd < 0) {
+        ALOGE("Unable to open DC0 or nvmap (%s), no DC overlay", strerror(errno));
+        goto fail;
+    }
+
+    if (ioctl(dev->dc_fd, TEGRA_DC_EXT_SET_NVMAP_FD, dev->nvmap_fd) < 0) {
+        ALOGE("Unable to hand nvmap to DC0 (%s), no DC overlay", strerror(errno));
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (dev->dc_fd >= 0)
+        close(dev->dc_fd);
+    if (dev->nvmap_fd >= 0)
+        close(dev->nvmap_fd);
+    dev->dc_fd = dev->nvmap_fd = -1;
+    return -ENODEV;
+}
+
+// Window A is the framebuffer. B scales best, C is the fallback when the
+// vendor module already holds B. Taken only while a video layer is shown,
+// so the vendor module has both the rest of the time.
+static bool dc_overlay_get_window(struct tegra2_hwc_composer_device_1_t *pdev)
+{
+    if (pdev->dc_window >= 0)
+        return true;
+    if (pdev->dc_window_busy)
+        return false;
+
+    for (int win = 1; win <= 2; win++) {
+        if (ioctl(pdev->dc_fd, TEGRA_DC_EXT_GET_WINDOW, win) == 0) {
+            pdev->dc_window = win;
+            ALOGV("Using DC0 window %c for video layers", 'A' + win);
+            return true;
+        }
+    }
+    pdev->dc_window_busy = true;
+    return false;
+}
+
+static void dc_overlay_put_window(struct tegra2_hwc_composer_device_1_t *pdev)
+{
+    if (pdev->dc_window < 0)
+        return;
+    ioctl(pdev->dc_fd, TEGRA_DC_EXT_PUT_WINDOW, pdev->dc_window);
+    pdev->dc_window = -1;
+}
+
+static inline uint32_t dc_overlay_handle_id(buffer_handle_t handle)
+{
+    return handle->numInts > TEGRA2_HWC_DC_OVERLAY_ID_INT
+        ? handle->data[handle->numFds + TEGRA2_HWC_DC_OVERLAY_ID_INT] : 0;
+}
+
+// Plane layout and nvmap id of a YUV buffer. Lookups, failed ones too, are
+// cached so gralloc is only asked once per buffer of the stream. gralloc may
+// hand a freed handle's address to a new buffer, so an entry only counts
+// while the handle still carries the same nvmap id.
+static bool dc_overlay_lookup(struct tegra2_hwc_composer_device_1_t *pdev,
+        buffer_handle_t handle, struct dc_overlay_buffer *buf)
+{
+    uint32_t id = dc_overlay_handle_id(handle);
+
+    for (unsigned int i = 0; i < DC_OVERLAY_CACHE; i++) {
+        if (pdev->dc_cache[i].handle == handle && pdev->dc_cache[i].handle_id == id) {
+            *buf = pdev->dc_cache[i];
+            return buf->id != 0;
+        }
+    }
+
+    memset(buf, 0, sizeof(*buf));
+    buf->handle = handle;
+    buf->handle_id = id;
+    buf->seen = pdev->dc_frame;
+
+    const gralloc_module_t *gralloc = pdev->gralloc;
+    struct android_ycbcr ycbcr;
+    if (gralloc && gralloc->common.module_api_version >= GRALLOC_MODULE_API_VERSION_0_2 &&
+        gralloc->lock_ycbcr && id != 0 &&
+        gralloc->lock_ycbcr(gralloc, handle, GRALLOC_USAGE_SW_READ_RARELY,
+            0, 0, 1, 1, &ycbcr) == 0) {
+        gralloc->unlock(gralloc, handle);
+
+        // Planar 4:2:0 only, Tegra 2 has no semi-planar scan-out
+        uint8_t *y = (uint8_t *)ycbcr.y;
+        if (ycbcr.chroma_step == 1 && (uint8_t *)ycbcr.cb > y && (uint8_t *)ycbcr.cr > y) {
+            buf->id = id;
+            buf->offset_u = (uint8_t *)ycbcr.cb - y;
+            buf->offset_v = (uint8_t *)ycbcr.cr - y;
+            buf->stride = ycbcr.ystride;
+            buf->stride_uv = ycbcr.cstride;
+        }
+    }
+
+    pdev->dc_cache[pdev->dc_cache_next] = *buf;
+    pdev->dc_cache_next = (pdev->dc_cache_next + 1) % DC_OVERLAY_CACHE;
+    return buf->id != 0;
+}
+
+/*
+ * Pick the layer for the DC window: an opaque YUV layer the window can
+ * scale, placed behind the framebuffer window. SurfaceFlinger clears the
+ * framebuffer to transparent under overlays, and window A blends over B/C.
+ * Returns the layer index or -1.
+ */
+static int dc_overlay_claim(struct tegra2_hwc_composer_device_1_t *pdev,
+        hwc_display_contents_1_t *contents)
+{
+    pdev->dc_layer = -1;
+    if (pdev->dc_fd < 0)
+        return -1;
+
+    // A new layer list may come with new buffers: look them up again, and
+    // try for a window again if none was free
+    if (contents->flags & HWC_GEOMETRY_CHANGED) {
+        memset(pdev->dc_cache, 0, sizeof(pdev->dc_cache));
+        pdev->dc_cache_next = 0;
+        pdev->dc_window_busy = false;
+    }
+
+    // A stream brings each of its buffers back within a few frames. One
+    // gone from the layer list for longer than that is forgotten.
+    pdev->dc_frame++;
+    for (unsigned int j = 0; j < DC_OVERLAY_CACHE; j++) {
+        struct dc_overlay_buffer *e = &pdev->dc_cache[j];
+        if (!e->handle)
+            continue;
+        for (size_t i = 0; i < contents->numHwLayers; i++) {
+            if (contents->hwLayers[i].handle == e->handle) {
+                e->seen = pdev->dc_frame;
+                break;
+            }
+        }
+        if (pdev->dc_frame - e->seen > DC_OVERLAY_CACHE)
+            memset(e, 0, sizeof(*e));
+    }
+
+    for (int i = contents->numHwLayers - 1; i >= 0; i--) {
+        hwc_layer_1_t *l = &contents->hwLayers[i];
+        const hwc_rect_t &c = l->sourceCrop;
+        const hwc_rect_t &f = l->displayFrame;
+
+        if (!l->handle || (l->flags & HWC_SKIP_LAYER) ||
+            l->blending != HWC_BLENDING_NONE || (l->transform & HWC_TRANSFORM_ROT_90))
+            continue;
+        if (i >= ACQUIRE_MAX_LAYERS || (pdev->late_layers & (1U << i)))
+            continue;
+        if (f.left < 0 || f.top < 0 || f.right > pdev->xres || f.bottom > pdev->yres ||
+            f.right <= f.left || f.bottom <= f.top || c.right <= c.left || c.bottom <= c.top)
+            continue;
+        if (c.right - c.left > DC_OVERLAY_MAX_DOWNSCALE * (f.right - f.left) ||
+            c.bottom - c.top > DC_OVERLAY_MAX_DOWNSCALE * (f.bottom - f.top))
+            continue;
+        if (!dc_overlay_lookup(pdev, l->handle, &pdev->dc_buf))
+            continue;
+        if (!dc_overlay_get_window(pdev))
+            break;
+
+        pdev->dc_layer = i;
+        return i;
+    }
+
+    // set() turns a window that is still showing a buffer off first
+    if (!pdev->dc_active)
+        dc_overlay_put_window(pdev);
+    return -1;
+}
+
+// Show the claimed layer on the DC window, or turn the window off
+static void dc_overlay_flip(struct tegra2_hwc_composer_device_1_t *pdev,
+        hwc_display_contents_1_t *contents)
+{
+    struct tegra_dc_ext_flip flip;
+    struct tegra_dc_ext_flip_windowattr *win = &flip.win[0];
+
+    if (pdev->dc_window < 0 || (pdev->dc_layer < 0 && !pdev->dc_active))
+        return;
+
+    memset(&flip, 0, sizeof(flip));
+    flip.win[1].index = -1;
+    flip.win[2].index = -1;
+    win->index = pdev->dc_window;
+    win->pre_syncpt_id = NVHOST_INVALID_SYNCPOINT;
+
+    if (contents && pdev->dc_layer >= 0 && (size_t)pdev->dc_layer < contents->numHwLayers) {
+        hwc_layer_1_t *l = &contents->hwLayers[pdev->dc_layer];
+        const struct dc_overlay_buffer *buf = &pdev->dc_buf;
+
+        win->buff_id = buf->id;
+        win->blend = TEGRA_DC_EXT_BLEND_NONE;
+        win->offset_u = buf->offset_u;
+        win->offset_v = buf->offset_v;
+        win->stride = buf->stride;
+        win->stride_uv = buf->stride_uv;
+        win->pixformat = TEGRA_DC_EXT_FMT_YCbCr420P;
+        // Source rectangle in 20.12 fixed point
+        win->x = l->sourceCrop.left << 12;
+        win->y = l->sourceCrop.top << 12;
+        win->w = (l->sourceCrop.right - l->sourceCrop.left) << 12;
+        win->h = (l->sourceCrop.bottom - l->sourceCrop.top) << 12;
+        win->out_x = l->displayFrame.left;
+        win->out_y = l->displayFrame.top;
+        win->out_w = l->displayFrame.right - l->displayFrame.left;
+        win->out_h = l->displayFrame.bottom - l->displayFrame.top;
+        win->z = 1;                         // behind window A
+        win->swap_interval = 1;
+        if (l->transform & HWC_TRANSFORM_FLIP_H)
+            win->flags |= TEGRA_DC_EXT_FLIP_FLAG_INVERT_H;
+        if (l->transform & HWC_TRANSFORM_FLIP_V)
+            win->flags |= TEGRA_DC_EXT_FLIP_FLAG_INVERT_V;
+    }
+    // buff_id 0 turns the window off
+
+    if (ioctl(pdev->dc_fd, TEGRA_DC_EXT_FLIP, &flip) < 0) {
+        ALOGE("DC window flip failed: %s", strerror(errno));
+        return;
+    }
+
+    // The buffer this flip replaces is scanned out until the flip latches
+    pthread_mutex_lock(&pdev->vsync_mutex);
+    pdev->dc_post_syncpt_id = flip.post_syncpt_id;
+    pdev->dc_post_syncpt_val = flip.post_syncpt_val;
+    pdev->dc_flip_pending = true;
+    pthread_mutex_unlock(&pdev->vsync_mutex);
+
+    pdev->dc_active = win->buff_id != 0;
+    pdev->dc_flips++;
+
+    if (!pdev->dc_active)
+        dc_overlay_put_window(pdev);
+}
+
+// Whether the last DC window flip has latched, so the buffer it replaced
+// may be released. Called with vsync_mutex held.
+static bool dc_overlay_retired(struct tegra2_hwc_composer_device_1_t *pdev)
+{
+    if (!pdev->dc_flip_pending)
+        return true;
+
+    struct nvhost_ctrl_syncpt_read_args ra;
+    ra.id = pdev->dc_post_syncpt_id;
+    if (pdev->nvhost_fd < 0 || ioctl(pdev->nvhost_fd, NVHOST_IOCTL_CTRL_SYNCPT_READ, &ra) < 0 ||
+        (int32_t)(ra.value - pdev->dc_post_syncpt_val) >= 0)
+        pdev->dc_flip_pending = false;
+    return !pdev->dc_flip_pending;
+}
+
+static void dc_overlay_close(struct tegra2_hwc_composer_device_1_t *pdev)
+{
+    if (pdev->dc_fd < 0)
+        return;
+
+    pdev->dc_layer = -1;
+    dc_overlay_flip(pdev, NULL);
+    dc_overlay_put_window(pdev);
+    close(pdev->dc_fd);
+    close(pdev->nvmap_fd);
+    pdev->dc_fd = pdev->nvmap_fd = -1;
+}
+
+#else
+
+static inline int dc_overlay_open(struct tegra2_hwc_composer_device_1_t *dev)
+{
+    dev->dc_window = -1;
+    dev->dc_layer = -1;
+    return -ENODEV;
+}
+
+static inline int dc_overlay_claim(struct tegra2_hwc_composer_device_1_t *pdev,
+        hwc_display_contents_1_t *)
+{
+    return pdev->dc_layer;
+}
+
+static inline void dc_overlay_flip(struct tegra2_hwc_composer_device_1_t *,
+        hwc_display_contents_1_t *)
+{
+}
+
+static inline bool dc_overlay_retired(struct tegra2_hwc_composer_device_1_t *)
+{
+    return true;
+}
+
+static inline void dc_overlay_close(struct tegra2_hwc_composer_device_1_t *)
+{
+}
+
+#endif /* TEGRA2_HWC_DC_OVERLAY */
+
+/* -- Overlay planner: which layers the vendor module may take
+ *
+ * Every layer is given two memory bandwidth costs, in bytes per frame:
+ *  - overlay: the DC fetching the source rectangle,
+ *  - GLES: the GPU reading the source and writing, and when blending also
+ *    reading, the framebuffer under the display frame.
+ * An overlay also costs a clear of its display frame when there is GLES
+ * composition, SurfaceFlinger punches a hole in the framebuffer for it.
+ *
+ * All assignments of the free DC windows to eligible layers are tried and
+ * the cheapest one wins. Layers left out get HWC_SKIP_LAYER, the vendor
+ * module still decides about the rest.
+ *
+ * This is a heuristic and stays off unless debug.hwc.planner=1:
+ *  - Buffer formats are private to the NVIDIA gralloc. A buffer that
+ *    lock_ycbcr() accepts is counted as 4:2:0 YUV, anything else as 32 bpp.
+ *  - The plan assumes the v0 module skips single layers marked
+ *    HWC_SKIP_LAYER instead of giving up on overlays for the whole frame.
+ *    That is not known for every blob; plans it takes no overlay from are
+ *    counted in dumpsys.
+ */
+
+#define PLANNER_FB_BPP              32  // framebuffer and unknown formats
+#define PLANNER_YUV_BPP             12
+#define PLANNER_DC_WINDOWS          3   // A is the framebuffer
+#define PLANNER_MAX_DOWNSCALE       2
+#define PLANNER_NONE                UINT64_MAX
+
+struct planner_layer {
+    uint64_t    overlay;                // PLANNER_NONE if the DC can't show it
+    uint64_t    gles;
+    uint64_t    clear;
+    uint32_t    fetch;                  // DC fetch per output pixel, 1/16 bytes
+    bool        opaque;
+};
+
+static inline bool planner_overlaps(const hwc_layer_1_t *a, const hwc_layer_1_t *b)
+{
+    const hwc_rect_t &fa = a->displayFrame;
+    const hwc_rect_t &fb = b->displayFrame;
+    return fa.left < fb.right && fb.left < fa.right && fa.top < fb.bottom && fb.top < fa.bottom;
+}
+
+// Looked up once per buffer, the cache is dropped on a geometry change
+static uint32_t planner_bpp(struct tegra2_hwc_composer_device_1_t *pdev,
+        buffer_handle_t handle)
+{
+    for (unsigned int i = 0; i < PLANNER_FORMAT_CACHE; i++) {
+        if (pdev->planner_formats[i].handle == handle)
+            return pdev->planner_formats[i].bpp;
+    }
+
+    uint32_t bpp = PLANNER_FB_BPP;
+    const gralloc_module_t *gralloc = pdev->gralloc;
+    struct android_ycbcr ycbcr;
+    if (gralloc && gralloc->common.module_api_version >= GRALLOC_MODULE_API_VERSION_0_2 &&
+        gralloc->lock_ycbcr &&
+        gralloc->lock_ycbcr(gralloc, handle, GRALLOC_USAGE_SW_READ_RARELY,
+            0, 0, 1, 1, &ycbcr) == 0) {
+        gralloc->unlock(gralloc, handle);
+        bpp = PLANNER_YUV_BPP;
+    }
+
+    pdev->planner_formats[pdev->planner_formats_next].handle = handle;
+    pdev->planner_formats[pdev->planner_formats_next].bpp = bpp;
+    pdev->planner_formats_next = (pdev->planner_formats_next + 1) % PLANNER_FORMAT_CACHE;
+    return bpp;
+}
+
+// p comes in zeroed
+static void planner_cost(struct tegra2_hwc_composer_device_1_t *pdev,
+        hwc_display_contents_1_t *contents, size_t i, struct planner_layer *p)
+{
+    const hwc_layer_1_t *l = &contents->hwLayers[i];
+    int64_t sw = l->sourceCrop.right - l->sourceCrop.left;
+    int64_t sh = l->sourceCrop.bottom - l->sourceCrop.top;
+    int64_t dw = l->displayFrame.right - l->displayFrame.left;
+    int64_t dh = l->displayFrame.bottom - l->displayFrame.top;
+
+    p->opaque = l->blending == HWC_BLENDING_NONE;
+    p->overlay = PLANNER_NONE;
+    if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0)
+        return;
+
+    // Costs are in bits until the end, the framebuffer side is always RGBX
+    int64_t bpp = l->handle ? planner_bpp(pdev, l->handle) : PLANNER_FB_BPP;
+    p->gles = (sw * sh * bpp + dw * dh * PLANNER_FB_BPP * (p->opaque ? 1 : 2)) / 8;
+    p->clear = dw * dh * PLANNER_FB_BPP / 8;
+    p->fetch = (uint32_t)((sw * sh * bpp * 2) / (dw * dh));
+
+    if (!l->handle || (l->flags & HWC_SKIP_LAYER) || (l->transform & HWC_TRANSFORM_ROT_90))
+        return;
+    if (pdev->late_layers & (1U << i))
+        return;
+    if (sw > PLANNER_MAX_DOWNSCALE * dw || sh > PLANNER_MAX_DOWNSCALE * dh)
+        return;
+
+    p->overlay = sw * sh * bpp / 8;
+}
+
+// Cost of one assignment, PLANNER_NONE if the DC or the z order can't do it
+static uint64_t planner_eval(const struct planner_layer *p, hwc_display_contents_1_t *contents,
+        size_t n, uint32_t overlays, uint32_t fetch_budget)
+{
+    uint64_t cost = 0, clear = 0;
+    uint32_t fetch = PLANNER_FB_BPP * 2;    // window A
+    bool gles = false;
+
+    for (size_t i = 0; i < n; i++) {
+        if (!(overlays & (1U << i))) {
+            cost += p[i].gles;
+            gles = true;
+            continue;
+        }
+
+        cost += p[i].overlay;
+        clear += p[i].clear;
+        fetch += p[i].fetch;
+
+        // A blended overlay can't show GLES layers it covers through the hole
+        if (!p[i].opaque) {
+            for (size_t j = 0; j < i; j++) {
+                if (!(overlays & (1U << j)) &&
+                    planner_overlaps(&contents->hwLayers[i], &contents->hwLayers[j]))
+                    return PLANNER_NONE;
+            }
+        }
+    }
+
+    if (fetch > fetch_budget)
+        return PLANNER_NONE;
+
+    return gles ? cost + clear : cost;
+}
+
+/*
+ * Returns the layers the vendor module may take as overlays. dc_layer is
+ * on a window of its own already and never offered.
+ */
+static uint32_t planner_plan(struct tegra2_hwc_composer_device_1_t *pdev,
+        hwc_display_contents_1_t *contents, int dc_layer)
+{
+    struct planner_layer p[ACQUIRE_MAX_LAYERS];
+    unsigned int cand[ACQUIRE_MAX_LAYERS];
+    size_t n = contents->numHwLayers, ncand = 0;
+    uint32_t fixed = 0;
+
+    if (n > ACQUIRE_MAX_LAYERS)
+        n = ACQUIRE_MAX_LAYERS;
+
+    memset(p, 0, sizeof(p));
+    for (size_t i = 0; i < n; i++) {
+        planner_cost(pdev, contents, i, &p[i]);
+        if ((int)i == dc_layer) {
+            // Costs the same as an overlay whatever the plan is
+            p[i].overlay = p[i].gles = p[i].clear = 0;
+            p[i].opaque = true;
+            fixed |= 1U << i;
+        } else if (p[i].overlay != PLANNER_NONE) {
+            cand[ncand++] = i;
+        }
+    }
+
+    int windows = PLANNER_DC_WINDOWS - 1 - (pdev->dc_window >= 0 ? 1 : 0);
+    uint64_t gles_cost = planner_eval(p, contents, n, fixed, UINT32_MAX);
+    uint64_t best_cost = gles_cost;
+    uint32_t best = fixed;
+
+    // At most two free windows: singles and pairs cover every assignment
+    for (size_t a = 0; windows >= 1 && a < ncand; a++) {
+        uint32_t one = fixed | (1U << cand[a]);
+        uint64_t cost = planner_eval(p, contents, n, one, pdev->planner_fetch_budget);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = one;
+        }
+
+        for (size_t b = a + 1; windows >= 2 && b < ncand; b++) {
+            uint32_t two = one | (1U << cand[b]);
+            cost = planner_eval(p, contents, n, two, pdev->planner_fetch_budget);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = two;
+            }
+        }
+    }
+
+    pdev->planner_runs++;
+    pdev->planner_cost = best_cost;
+    pdev->planner_gles_cost = gles_cost;
+
+    return best & ~fixed;
+}
 
-    hwc_display_contents_1_t *contents = displays[0];
+static int tegra2_set_primary(tegra2_hwc_composer_device_1_t *pdev,
+        hwc_display_contents_1_t *contents)
+{
     if (!contents || !contents->numHwLayers)
         return 0;
 
@@ -238,29 +1380,104 @@ static int tegra2_set(struct hwc_composer_device_1 *dev,
     if (pdev->fbblanked)
         return -ENODEV;
 
+    int64_t t = 0;
+    if (pdev->profile && pdev->profile_cur.start_ns) {
+        t = monotonic_ns();
+        int64_t vsync = __atomic_load_n(&pdev->last_vsync_ns, __ATOMIC_RELAXED);
+        if (vsync > 0)
+            pdev->profile_cur.stage_us[PROFILE_SINCE_VSYNC] = (t - vsync) / 1000;
+    }
+
+    // New buffers end an idle period before they are flipped
+    if (pdev->idle_running) {
+        uint32_t hash = hash_handles(contents);
+        if (hash != pdev->idle_hash || (contents->flags & HWC_GEOMETRY_CHANGED)) {
+            pdev->idle_hash = hash;
+            idle_update(pdev);
+        }
+    }
+
+    // Overlay buffers must be complete before the vendor module flips them
+    uint32_t unready;
+    uint32_t late = wait_acquire_fences(pdev, contents, &unready);
+    profile_stage(pdev, PROFILE_ACQUIRE, &t);
+    if (late) {
+        pdev->late_layers |= late;
+        pdev->late_frames = ACQUIRE_LATE_FRAMES;
+        pdev->prepare_cache_valid = false;
+    } else if (pdev->late_layers && --pdev->late_frames == 0) {
+        pdev->late_layers = 0;
+        pdev->prepare_cache_valid = false;
+    }
+
     int reqsz = sizeof (hwc_layer_list_t) + sizeof(hwc_layer_t) * contents->numHwLayers;
     pdev->set_xlatebufsz =
         ensure_xlatebuf(&pdev->set_xlatebuf, pdev->set_xlatebufsz, reqsz);
 
     hwc_layer_list_t* lst = (hwc_layer_list_t*)pdev->set_xlatebuf;
 
-    copy_display_contents_1_to_layer_list(lst,contents);
+    hwc_xlate_contents_to_list(lst, contents);
+    for (size_t i = 0; unready && i < lst->numHwLayers && i < ACQUIRE_MAX_LAYERS; i++) {
+        if (unready & (1U << i)) {
+            lst->hwLayers[i].compositionType = HWC_FRAMEBUFFER;
+            lst->hwLayers[i].flags |= HWC_SKIP_LAYER;
+        }
+    }
+    profile_stage(pdev, PROFILE_SET_XLATE, &t);
+
+    // The DC window layer is flipped here, the vendor module must skip it
+    int dc_layer = pdev->dc_layer;
+    if (dc_layer >= 0 && (size_t)dc_layer < lst->numHwLayers) {
+        lst->hwLayers[dc_layer].compositionType = HWC_FRAMEBUFFER;
+        lst->hwLayers[dc_layer].flags |= HWC_SKIP_LAYER;
+    }
+    if (dc_layer >= 0 && (unready & (1U << dc_layer)))
+        dc_overlay_flip(pdev, NULL);
+    else
+        dc_overlay_flip(pdev, contents);
+
     int ret = pdev->org->set(pdev->org, contents->dpy, contents->sur, lst);
-    copy_layer_list_to_display_contents_1(contents,lst);
+    hwc_xlate_list_to_contents(contents, lst);
+    if (dc_layer >= 0 && (size_t)dc_layer < contents->numHwLayers)
+        contents->hwLayers[dc_layer].compositionType = HWC_OVERLAY;
+    profile_stage(pdev, PROFILE_SET, &t);
+
+    // Overlay buffers of this frame are released once the next frame is
+    // scanned out, the rest were composited by SurfaceFlinger already
+    unsigned int release_value = pdev->sync_release_value + 2;
 
-    //Wait until all buffers are available
     unsigned int d;
     for (d = 0; d < contents->numHwLayers; d++) {
 
+        // A buffer left out of this frame is free once its producer is done
+        if (d < ACQUIRE_MAX_LAYERS && (unready & (1U << d))) {
+            contents->hwLayers[d].releaseFenceFd = contents->hwLayers[d].acquireFenceFd;
+            contents->hwLayers[d].acquireFenceFd = -1;
+            continue;
+        }
+
         // Release handles we own...
         if (contents->hwLayers[d].acquireFenceFd >= 0)
             close(contents->hwLayers[d].acquireFenceFd);
         contents->hwLayers[d].acquireFenceFd = -1;
 
-        // And let surfaceFlinger read inmediately...
         contents->hwLayers[d].releaseFenceFd = -1;
+        if (pdev->sync_timeline_fd >= 0 &&
+            contents->hwLayers[d].compositionType == HWC_OVERLAY)
+            contents->hwLayers[d].releaseFenceFd =
+                sw_sync_timeline_fence(pdev->sync_timeline_fd, release_value);
     }
 
+    // ...and this frame releases the previous one at the next vblank. The
+    // vsync thread runs for it even while SurfaceFlinger has vsync off.
+    pthread_mutex_lock(&pdev->vsync_mutex);
+    pdev->sync_release_value++;
+    pdev->sync_release_ns = monotonic_ns();
+    pthread_cond_signal(&pdev->vsync_cond);
+    pthread_mutex_unlock(&pdev->vsync_mutex);
+    profile_stage(pdev, PROFILE_RELEASE, &t);
+    profile_commit(pdev);
+
     return ret;
 }
 
@@ -273,7 +1490,8 @@ static int tegra2_prepare(hwc_composer_device_1_t *dev,
     tegra2_hwc_composer_device_1_t *pdev =
         (tegra2_hwc_composer_device_1_t *)dev;
 
-    hwc_display_contents_1_t *contents = displays[0];
+
+    hwc_display_contents_1_t *contents = displays[HWC_DISPLAY_PRIMARY];
     if (!contents || !contents->numHwLayers)
         return 0;
 
@@ -283,9 +1501,16 @@ static int tegra2_prepare(hwc_composer_device_1_t *dev,
 
     ALOGV("preparing %u layers", contents->numHwLayers);
 
+    int64_t t = 0;
+    if (pdev->profile) {
+        memset(&pdev->profile_cur, 0, sizeof(pdev->profile_cur));
+        t = pdev->profile_cur.start_ns = monotonic_ns();
+        pdev->profile_cur.layers = contents->numHwLayers;
+    }
+
     int reqsz = sizeof (hwc_layer_list_t) + sizeof(hwc_layer_t) * contents->numHwLayers;
     pdev->prepare_xlatebufsz =
-        ensure_xlatebuf(&pdev->prepare_xlatebuf, pdev->set_xlatebufsz, reqsz);
+        ensure_xlatebuf(&pdev->prepare_xlatebuf, pdev->prepare_xlatebufsz, reqsz);
 
     hwc_layer_list_t* lst = (hwc_layer_list_t*) pdev->prepare_xlatebuf;
 
@@ -316,16 +1541,224 @@ static int tegra2_prepare(hwc_composer_device_1_t *dev,
     }
 #endif
 
-    copy_display_contents_1_to_layer_list(lst,contents);
+    // Layer indices are meaningless after a geometry change
+    if (contents->flags & HWC_GEOMETRY_CHANGED) {
+        pdev->late_layers = 0;
+        memset(pdev->planner_formats, 0, sizeof(pdev->planner_formats));
+        pdev->planner_formats_next = 0;
+    }
+
+    // A video layer on the DC window is hidden from the vendor module
+    int dc_layer = dc_overlay_claim(pdev, contents);
+
+    // Nothing the vendor module looks at has changed: reuse its last answer
+    uint32_t hash = 0;
+    if (pdev->prepare_cache) {
+        hash = hash_geometry(pdev, contents);
+        hash = fnv1a(hash, &dc_layer, sizeof(dc_layer));
+        if (pdev->prepare_cache_valid &&
+            !(contents->flags & HWC_GEOMETRY_CHANGED) &&
+            hash == pdev->prepare_cache_hash &&
+            lst->numHwLayers == contents->numHwLayers) {
+            hwc_xlate_list_to_contents(contents, lst);
+            if (dc_layer >= 0)
+                contents->hwLayers[dc_layer].compositionType = HWC_OVERLAY;
+            pdev->prepare_cache_hits++;
+            pdev->profile_cur.cache_hit = true;
+            profile_count_overlays(pdev, contents);
+            return 0;
+        }
+        pdev->prepare_cache_misses++;
+    }
+
+    hwc_xlate_contents_to_list(lst, contents);
+    profile_stage(pdev, PROFILE_PREPARE_XLATE, &t);
+
+    // Keep late producers, and layers the acquire masks cannot track, away
+    // from the overlays
+    for (size_t i = 0; i < contents->numHwLayers; i++) {
+        if (i >= ACQUIRE_MAX_LAYERS || (pdev->late_layers & (1U << i)))
+            lst->hwLayers[i].flags |= HWC_SKIP_LAYER;
+    }
+    if (dc_layer >= 0)
+        lst->hwLayers[dc_layer].flags |= HWC_SKIP_LAYER;
+
+    // Only the layers the cost model picked may become overlays
+    if (pdev->planner) {
+        pdev->planner_overlays = planner_plan(pdev, contents, dc_layer);
+        for (size_t i = 0; i < contents->numHwLayers; i++) {
+            if (i >= ACQUIRE_MAX_LAYERS || !(pdev->planner_overlays & (1U << i)))
+                lst->hwLayers[i].flags |= HWC_SKIP_LAYER;
+        }
+    }
 
     int ret = pdev->org->prepare(pdev->org, lst);
 
-    copy_layer_list_to_display_contents_1(contents,lst);
+    hwc_xlate_list_to_contents(contents, lst);
+    if (dc_layer >= 0)
+        contents->hwLayers[dc_layer].compositionType = HWC_OVERLAY;
+    if (pdev->planner && pdev->planner_overlays) {
+        bool taken = false;
+        for (size_t i = 0; i < contents->numHwLayers && i < ACQUIRE_MAX_LAYERS; i++)
+            taken |= (pdev->planner_overlays & (1U << i)) &&
+                contents->hwLayers[i].compositionType == HWC_OVERLAY;
+        if (!taken)
+            pdev->planner_declined++;
+    }
+    profile_stage(pdev, PROFILE_PREPARE, &t);
+    profile_count_overlays(pdev, contents);
+
+    pdev->prepare_cache_valid = (ret == 0);
+    pdev->prepare_cache_hash = hash;
 
     return ret;
 }
 
-/* VSync thread emulator */
+static int tegra2_set(struct hwc_composer_device_1 *dev,
+        size_t numDisplays, hwc_display_contents_1_t** displays)
+{
+    if (!numDisplays || !displays)
+        return 0;
+
+    tegra2_hwc_composer_device_1_t *pdev = (tegra2_hwc_composer_device_1_t *)dev;
+
+    return tegra2_set_primary(pdev, displays[HWC_DISPLAY_PRIMARY]);
+}
+
+/* VSync thread emulator
+ *
+ * Ticks sit on a fixed grid of absolute deadlines, so waking up late never
+ * shifts the phase; whole frames slept through are skipped and the reported
+ * timestamp is always the grid point itself. When the framebuffer supports
+ * FBIO_WAITFORVSYNC, a separate thread samples the real vblanks every few
+ * frames and a phase-locked loop pulls the grid onto them. The ticks never
+ * wait for a vblank themselves.
+ */
+#define PLL_SAMPLE_FRAMES       16      // frames between reference samples
+#define PLL_REF_VBLANKS         4       // vblanks waited for per reference
+#define PLL_PHASE_SHIFT         1       // phase correction: error / 2
+#define PLL_FREQ_SHIFT          3       // period correction: error / 8 per frame
+#define PLL_MAX_DEVIATION       200     // period stays within nominal +/- 1/200
+#define PLL_LOCK_NS             100000LL
+
+static int wait_deadline(int tfd, int64_t deadline_ns)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000LL;
+    ts.tv_nsec = deadline_ns % 1000000000LL;
+
+    if (tfd < 0) {
+        int err;
+        do {
+            err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        } while (err == EINTR);
+        return -err;
+    }
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value = ts;
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        return -errno;
+
+    uint64_t expirations;
+    ssize_t ret;
+    do {
+        ret = read(tfd, &expirations, sizeof(expirations));
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : 0;
+}
+
+// Feed one real vblank timestamp into the loop
+static void pll_update(struct tegra2_hwc_composer_device_1_t *pdev,
+        int64_t *grid_ns, int64_t *period_ns, int64_t ref_ns)
+{
+    int64_t nominal = pdev->time_between_frames_ns;
+    int64_t period = *period_ns;
+
+    // Distance to the closest grid point, in [-period/2, period/2)
+    int64_t err = (ref_ns - *grid_ns) % period;
+    if (err < 0)
+        err += period;
+    if (err >= period / 2)
+        err -= period;
+
+    *grid_ns += err >> PLL_PHASE_SHIFT;
+
+    period += (err / PLL_SAMPLE_FRAMES) >> PLL_FREQ_SHIFT;
+    if (period > nominal + nominal / PLL_MAX_DEVIATION)
+        period = nominal + nominal / PLL_MAX_DEVIATION;
+    if (period < nominal - nominal / PLL_MAX_DEVIATION)
+        period = nominal - nominal / PLL_MAX_DEVIATION;
+    *period_ns = period;
+
+    pdev->pll_error_ns = err;
+    pdev->pll_period_ns = period;
+    bool locked = llabs(err) < PLL_LOCK_NS;
+    if (locked != pdev->pll_locked)
+        ALOGD("Emulated VSYNC %s (phase error %lld ns)",
+            locked ? "locked" : "lost lock", (long long) err);
+    pdev->pll_locked = locked;
+}
+
+/*
+ * Reference sampler of the emulated VSYNC. FBIO_WAITFORVSYNC returns after
+ * the interrupt and a wakeup, and both only ever add latency: of a few
+ * consecutive vblanks, the one that came back earliest against the period
+ * is the closest to the real scan-out.
+ */
+static void *tegra2_hwc_vblank_ref_thread(void *data)
+{
+    struct tegra2_hwc_composer_device_1_t *pdev =
+            (struct tegra2_hwc_composer_device_1_t *) data;
+
+    androidSetThreadPriority(0, HAL_PRIORITY_URGENT_DISPLAY
+            + ANDROID_PRIORITY_MORE_FAVORABLE);
+
+    pthread_mutex_lock(&pdev->vsync_mutex);
+    while (1) {
+        while (pdev->ref_running && !pdev->ref_request)
+            pthread_cond_wait(&pdev->ref_cond, &pdev->vsync_mutex);
+        if (!pdev->ref_running)
+            break;
+        pdev->ref_request = false;
+        int64_t period = pdev->pll_period_ns;
+        unsigned int refresh_gen = pdev->refresh_gen;
+        pthread_mutex_unlock(&pdev->vsync_mutex);
+
+        int64_t earliest = INT64_MAX, latest = INT64_MIN;
+        int err = 0;
+        for (int i = 0; i < PLL_REF_VBLANKS; i++) {
+            __u32 crtc = 0;
+
+            if (ioctl(pdev->fb_fd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+                err = errno;
+                break;
+            }
+            // Phase of vblank i, moved back onto the first one
+            int64_t t = monotonic_ns() - i * period;
+            earliest = t < earliest ? t : earliest;
+            latest = t > latest ? t : latest;
+        }
+
+        pthread_mutex_lock(&pdev->vsync_mutex);
+        if (err) {
+            ALOGW("FBIO_WAITFORVSYNC unsupported (%s), running open loop", strerror(err));
+            pdev->ref_failed = true;
+            break;
+        }
+        if (refresh_gen != pdev->refresh_gen)
+            continue;
+        pdev->ref_ns = earliest + (PLL_REF_VBLANKS - 1) * period;
+        pdev->pll_spread_ns = latest - earliest;
+        pdev->ref_ready = true;
+    }
+    pthread_mutex_unlock(&pdev->vsync_mutex);
+
+    return NULL;
+}
+
 static void *tegra2_hwc_emulated_vsync_thread(void *data)
 {
      struct tegra2_hwc_composer_device_1_t *pdev =
@@ -339,74 +1772,112 @@ static void *tegra2_hwc_emulated_vsync_thread(void *data)
     android_set_rt_ioprio(0, 1);
 #endif
 
-    // Store the time of the start of this thread as an initial timestamp
-    struct timespec nexttm;
-    clock_gettime(CLOCK_MONOTONIC,&nexttm);
-    signed long long nexttm_ns = (nexttm.tv_sec) * 1000000000LL + (nexttm.tv_nsec);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd < 0)
+        ALOGW("timerfd unavailable (%s), using clock_nanosleep", strerror(errno));
 
-    while (1) {
-        int err;
+    bool has_ref = pdev->fb_fd >= 0;
+    unsigned int frames = 0;
+
+    if (has_ref) {
+        pdev->ref_running = true;
+        if (pthread_create(&pdev->ref_thread, NULL, tegra2_hwc_vblank_ref_thread, pdev)) {
+            ALOGW("Unable to start the VSYNC reference thread, running open loop");
+            pdev->ref_running = false;
+            has_ref = false;
+        }
+    }
+
+    int64_t period_ns = pdev->time_between_frames_ns;
+    int64_t grid_ns = monotonic_ns();
+    unsigned int refresh_gen = pdev->refresh_gen;
+    pdev->pll_period_ns = period_ns;
 
+    while (1) {
         // Wait while display is blanked
         pthread_mutex_lock(&pdev->vsync_mutex);
-        if (pdev->fbblanked || !pdev->enabled_vsync) {
+        if ((pdev->fbblanked || (!pdev->enabled_vsync && !sw_sync_release_pending(pdev))) &&
+                pdev->vsync_running) {
 
             // When framebuffer is blanked, there must be no interrupts, so we can't wait on it
             pthread_cond_wait(&pdev->vsync_cond, &pdev->vsync_mutex);
         }
         if (unlikely(!pdev->vsync_running))
             break;
-        pthread_mutex_unlock(&pdev->vsync_mutex);
-
-        // Estimate time of next emulated VSYNC
-        nexttm_ns += pdev->time_between_frames_ns;
-
-        // get current time
-        struct timespec currtm;
-        clock_gettime(CLOCK_MONOTONIC,&currtm);
-
-        // Calculate the delay for that next time
-        signed long long deltatm_ns
-            = nexttm_ns - ((currtm.tv_sec) * 1000000000LL + (currtm.tv_nsec));
-
-        // If we lost lock on emulated VSYNC...
-        if (deltatm_ns < 0 || deltatm_ns > (signed long long) pdev->time_between_frames_ns) {
-            // Restart emulation
-
-            // Store the current time as the time of the start of this thread
-            clock_gettime(CLOCK_MONOTONIC,&nexttm);
-            nexttm_ns = (nexttm.tv_sec) * 1000000000LL + (nexttm.tv_nsec);
-
-            deltatm_ns = 0;
+        // The panel timings changed, start over from the new frame time.
+        // A reference sampled at the old period would pull the grid off.
+        if (unlikely(refresh_gen != pdev->refresh_gen)) {
+            refresh_gen = pdev->refresh_gen;
+            period_ns = pdev->time_between_frames_ns;
+            pdev->pll_period_ns = period_ns;
+            pdev->pll_error_ns = 0;
+            pdev->pll_locked = false;
+            pdev->ref_ready = false;
+            frames = 0;
         }
+        pthread_mutex_unlock(&pdev->vsync_mutex);
 
-        // If something to wait ... wait!
-        if (deltatm_ns > 0) {
+        // Next grid point, skipping the ones slept through while blanked,
+        // disabled or stalled
+        int64_t next_ns = grid_ns + period_ns;
+        int64_t now_ns = monotonic_ns();
+        if (now_ns - next_ns >= period_ns)
+            next_ns += ((now_ns - next_ns) / period_ns) * period_ns;
 
-            struct timespec ts;
-            ts.tv_sec = 0;
-            ts.tv_nsec = deltatm_ns;
-
-            do {
-                err = nanosleep (&ts, &ts);
-            } while (err < 0 && errno == EINTR);
+        if (wait_deadline(tfd, next_ns) < 0) {
+            ALOGE("Failed to wait for emulated VSYNC, stopping");
+            pthread_mutex_lock(&pdev->vsync_mutex);
+            break;
         }
+        grid_ns = next_ns;
 
         // Do the VSYNC call
         if (likely(pdev->enabled_vsync && !pdev->fbblanked)) {
+            __atomic_store_n(&pdev->last_vsync_ns, grid_ns, __ATOMIC_RELAXED);
+            pdev->procs->vsync(pdev->procs, 0, grid_ns);
+        }
 
-            // Get current time in exactly the same timebase as Choreographer
-            struct timespec now;
-            clock_gettime(CLOCK_MONOTONIC,&now);
+        pthread_mutex_lock(&pdev->vsync_mutex);
+        if (dc_overlay_retired(pdev))
+            sw_sync_timeline_vblank(pdev, grid_ns);
+        pthread_mutex_unlock(&pdev->vsync_mutex);
 
-            int64_t now_ns = (int64_t)(now.tv_sec * 1000000000ULL) + (int64_t)now.tv_nsec;
-            pdev->procs->vsync(pdev->procs, 0, now_ns);
-        }
+        // Discipline the grid against the real scan-out now and then
+        if (has_ref) {
+            bool ready = false;
+            int64_t ref_ns = 0;
+
+            pthread_mutex_lock(&pdev->vsync_mutex);
+            if (pdev->ref_ready) {
+                ready = true;
+                ref_ns = pdev->ref_ns;
+                pdev->ref_ready = false;
+            } else if (pdev->ref_failed) {
+                has_ref = false;
+            } else if (++frames >= PLL_SAMPLE_FRAMES && !pdev->fbblanked &&
+                    !pdev->ref_request) {
+                frames = 0;
+                pdev->ref_request = true;
+                pthread_cond_signal(&pdev->ref_cond);
+            }
+            pthread_mutex_unlock(&pdev->vsync_mutex);
 
+            if (ready)
+                pll_update(pdev, &grid_ns, &period_ns, ref_ns);
+        }
     };
 
+    bool join_ref = pdev->ref_running;
+    pdev->ref_running = false;
+    pthread_cond_signal(&pdev->ref_cond);
     pthread_mutex_unlock(&pdev->vsync_mutex);
 
+    if (join_ref)
+        pthread_join(pdev->ref_thread, NULL);
+
+    if (tfd >= 0)
+        close(tfd);
+
     ALOGD("VSYNC thread emulator ended");
 
     return NULL;
@@ -579,12 +2050,146 @@ static int tegra2_wait_vsync(struct tegra2_hwc_composer_device_1_t *pdev,
     return 0;
 }
 
+/* -- VSYNC timestamp model for the syncpoint path */
+
+static void vsync_model_reset(struct vsync_model *m)
+{
+    m->count = 0;
+    m->head = 0;
+    m->valid = false;
+    m->outliers = 0;
+}
+
+static inline int64_t vsync_model_predict(const struct vsync_model *m, uint32_t syncpt)
+{
+    return m->base_ns + (int64_t)((int32_t)(syncpt - m->base_syncpt) * m->period_ns);
+}
+
+// Least squares fit of timestamp against syncpoint value, relative to the
+// newest sample to keep the sums small
+static void vsync_model_fit(struct vsync_model *m, int64_t nominal_ns)
+{
+    unsigned int newest = (m->head + VSYNC_MODEL_SAMPLES - 1) % VSYNC_MODEL_SAMPLES;
+    uint32_t ref_syncpt = m->syncpt[newest];
+    int64_t ref_ns = m->ts_ns[newest];
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+    for (unsigned int i = 0; i < m->count; i++) {
+        double x = (int32_t)(m->syncpt[i] - ref_syncpt);
+        double y = m->ts_ns[i] - ref_ns;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    double n = m->count;
+    double det = n * sxx - sx * sx;
+    if (det <= 0)
+        return;
+
+    double period = (n * sxy - sx * sy) / det;
+    double offset = (sy - period * sx) / n;
+
+    // A fit this far off the panel timings means the samples are garbage
+    if (period < nominal_ns * 0.9 || period > nominal_ns * 1.1) {
+        vsync_model_reset(m);
+        return;
+    }
+
+    m->period_ns = period;
+    m->base_syncpt = ref_syncpt;
+    m->base_ns = ref_ns + (int64_t)offset;
+    m->valid = true;
+}
+
+// Returns the corrected timestamp of the vblank that moved the syncpoint to
+// the given value
+static int64_t vsync_model_update(struct vsync_model *m, uint32_t syncpt,
+        int64_t raw_ns, int64_t nominal_ns)
+{
+    if (m->valid) {
+        int64_t predicted = vsync_model_predict(m, syncpt);
+        if (llabs(raw_ns - predicted) > VSYNC_OUTLIER_NS) {
+            m->rejected++;
+            if (++m->outliers < VSYNC_MAX_OUTLIERS)
+                return predicted;
+            // Consistently off: the display was reconfigured or paused
+            vsync_model_reset(m);
+        }
+        m->outliers = 0;
+    }
+
+    m->syncpt[m->head] = syncpt;
+    m->ts_ns[m->head] = raw_ns;
+    m->head = (m->head + 1) % VSYNC_MODEL_SAMPLES;
+    if (m->count < VSYNC_MODEL_SAMPLES)
+        m->count++;
+
+    if (m->count >= VSYNC_MODEL_MIN_SAMPLES)
+        vsync_model_fit(m, nominal_ns);
+
+    return m->valid ? vsync_model_predict(m, syncpt) : raw_ns;
+}
+
+static void vsync_trace_add(struct tegra2_hwc_composer_device_1_t *pdev, uint32_t syncpt,
+        int64_t raw_ns, int64_t filtered_ns, int64_t latency_ns)
+{
+    unsigned int idx = pdev->vsync_trace_count % VSYNC_TRACE_SIZE;
+    struct vsync_trace_entry *e = &pdev->vsync_trace[idx];
+    uint32_t seq = e->seq;
+
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->syncpt = syncpt;
+    e->raw_ns = raw_ns;
+    e->filtered_ns = filtered_ns;
+    e->latency_ns = latency_ns;
+    __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&pdev->vsync_trace_count, pdev->vsync_trace_count + 1, __ATOMIC_RELEASE);
+}
+
+static int vsync_trace_dump(struct tegra2_hwc_composer_device_1_t *pdev, char *buff, int buff_len)
+{
+    unsigned int count = __atomic_load_n(&pdev->vsync_trace_count, __ATOMIC_ACQUIRE);
+    unsigned int n = count < VSYNC_TRACE_DUMP ? count : VSYNC_TRACE_DUMP;
+    int len = 0;
+
+    if (!count)
+        return 0;
+
+    len += snprintf(buff + len, buff_len - len,
+        "  vsync model: period %.1f ns, %s, %u samples rejected\n"
+        "    syncpt        raw (ns)   filtered - raw   wakeup latency\n",
+        pdev->vsync_model.period_ns, pdev->vsync_model.valid ? "valid" : "not valid",
+        pdev->vsync_model.rejected);
+
+    for (unsigned int i = count - n; i < count && len < buff_len; i++) {
+        struct vsync_trace_entry *e = &pdev->vsync_trace[i % VSYNC_TRACE_SIZE];
+        struct vsync_trace_entry copy;
+
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        copy = *e;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((seq & 1) || seq != __atomic_load_n(&e->seq, __ATOMIC_RELAXED))
+            continue;   // being rewritten
+
+        len += snprintf(buff + len, buff_len - len,
+            "    %6u %15lld %16lld %16lld\n", copy.syncpt, (long long) copy.raw_ns,
+            (long long) (copy.filtered_ns - copy.raw_ns), (long long) copy.latency_ns);
+    }
+
+    return len < buff_len ? len : buff_len;
+}
+
 /* VSync thread using Nvidia syncpoint waits */
 static void *tegra2_hwc_nv_vsync_thread(void *data)
 {
      struct tegra2_hwc_composer_device_1_t *pdev =
             (struct tegra2_hwc_composer_device_1_t *) data;
     unsigned int value = 0;
+    unsigned int refresh_gen = pdev->refresh_gen;
     struct timespec now;
     int err;
 
@@ -605,7 +2210,8 @@ static void *tegra2_hwc_nv_vsync_thread(void *data)
     while (1) {
         // Wait while display is blanked
         pthread_mutex_lock(&pdev->vsync_mutex);
-        if (pdev->fbblanked || !pdev->enabled_vsync) {
+        if ((pdev->fbblanked || (!pdev->enabled_vsync && !sw_sync_release_pending(pdev))) &&
+                pdev->vsync_running) {
 
             // When framebuffer is blanked, there must be no interrupts, so we can't wait on it
             pthread_cond_wait(&pdev->vsync_cond, &pdev->vsync_mutex);
@@ -615,9 +2221,17 @@ static void *tegra2_hwc_nv_vsync_thread(void *data)
                 ALOGE("Failed to read VBLANK syncpoint value!");
                 break;
             }
+
+            // Vblanks are not counted reliably while nobody waits on them
+            vsync_model_reset(&pdev->vsync_model);
         }
         if (unlikely(!pdev->vsync_running))
             break;
+        // Samples from the old panel timings do not fit the new ones
+        if (unlikely(refresh_gen != pdev->refresh_gen)) {
+            refresh_gen = pdev->refresh_gen;
+            vsync_model_reset(&pdev->vsync_model);
+        }
         pthread_mutex_unlock(&pdev->vsync_mutex);
 
         // Wait for the next vsync
@@ -626,11 +2240,29 @@ static void *tegra2_hwc_nv_vsync_thread(void *data)
         if (err)
             clock_gettime(CLOCK_MONOTONIC, &now);
 
+        int64_t now_ns = (int64_t)(now.tv_sec * 1000000000ULL) + (int64_t)now.tv_nsec;
+
+        // Replace the raw timestamp, which carries the wakeup latency with
+        // WAITEX, by the fitted one. Only WAITMEX timestamps come from the
+        // interrupt, so only there the latency itself can be measured.
+        if (!err) {
+            int64_t wake_ns = monotonic_ns();
+            int64_t filtered_ns = vsync_model_update(&pdev->vsync_model, value, now_ns,
+                    pdev->time_between_frames_ns);
+            vsync_trace_add(pdev, value, now_ns, filtered_ns, wake_ns - now_ns);
+            now_ns = filtered_ns;
+        }
+
         // Do the VSYNC call
         if (pdev->enabled_vsync && !pdev->fbblanked) {
-            int64_t now_ns = (int64_t)(now.tv_sec * 1000000000ULL) + (int64_t)now.tv_nsec;
+            __atomic_store_n(&pdev->last_vsync_ns, now_ns, __ATOMIC_RELAXED);
             pdev->procs->vsync(pdev->procs, 0, now_ns);
         }
+
+        pthread_mutex_lock(&pdev->vsync_mutex);
+        if (dc_overlay_retired(pdev))
+            sw_sync_timeline_vblank(pdev, now_ns);
+        pthread_mutex_unlock(&pdev->vsync_mutex);
     };
 
     pthread_mutex_unlock(&pdev->vsync_mutex);
@@ -679,9 +2311,23 @@ static int tegra2_blank(struct hwc_composer_device_1 *dev, int disp, int blank)
     // Store framebuffer status
     pthread_mutex_lock(&pdev->vsync_mutex);
     pdev->fbblanked = blank;
+    pdev->prepare_cache_valid = false;
+    // Nothing is scanned out anymore, let go of the last frame
+    if (blank)
+        sw_sync_timeline_advance_to(pdev, pdev->sync_release_value + 1);
     pthread_cond_signal(&pdev->vsync_cond);
     pthread_mutex_unlock(&pdev->vsync_mutex);
 
+    // Come back at full rate
+    if (!blank && pdev->idle_running)
+        idle_update(pdev);
+
+    // Nothing may stay on the DC window while the panel is off
+    if (blank) {
+        pdev->dc_layer = -1;
+        dc_overlay_flip(pdev, NULL);
+    }
+
     /* Blanking is handled by other means, no need to blank screen here */
     return 0;
 }
@@ -739,6 +2385,47 @@ static void tegra2_dump(hwc_composer_device_1* dev, char *buff, int buff_len)
         pdev->org->dump(pdev->org,buff,buff_len);
     else
         *buff = 0;
+
+    int len = strlen(buff);
+    if (len < buff_len && pdev->prepare_cache)
+        len += snprintf(buff + len, buff_len - len,
+            "  prepare cache: %u hits, %u misses\n",
+            pdev->prepare_cache_hits, pdev->prepare_cache_misses);
+    if (len < buff_len && pdev->planner)
+        len += snprintf(buff + len, buff_len - len,
+            "  overlay planner: %u plans, %u declined, layers 0x%08x, "
+            "%llu KiB/frame (all GLES %llu)\n",
+            pdev->planner_runs, pdev->planner_declined, pdev->planner_overlays,
+            (unsigned long long)(pdev->planner_cost / 1024),
+            (unsigned long long)(pdev->planner_gles_cost / 1024));
+    if (len < buff_len)
+        snprintf(buff + len, buff_len - len,
+            "  acquire fences: <0.5ms %u, <1ms %u, <2ms %u, <4ms %u, <8ms %u, "
+            "<16ms %u, >=16ms %u, missed vsync %u, layers on GLES 0x%08x\n",
+            pdev->acquire_hist[0], pdev->acquire_hist[1], pdev->acquire_hist[2],
+            pdev->acquire_hist[3], pdev->acquire_hist[4], pdev->acquire_hist[5],
+            pdev->acquire_hist[6], pdev->acquire_missed, pdev->late_layers);
+    len = strlen(buff);
+    if (len < buff_len && pdev->profile)
+        len += profile_dump(pdev, buff + len, buff_len - len);
+    if (len < buff_len && !pdev->vsync_emulated)
+        len += vsync_trace_dump(pdev, buff + len, buff_len - len);
+    if (len < buff_len && pdev->vsync_emulated)
+        len += snprintf(buff + len, buff_len - len,
+            "  emulated vsync: period %lld ns, phase error %lld ns, %s, "
+            "reference spread %lld ns\n",
+            (long long) pdev->pll_period_ns, (long long) pdev->pll_error_ns,
+            pdev->pll_locked ? "locked" : "unlocked", (long long) pdev->pll_spread_ns);
+    if (len < buff_len && pdev->dc_fd >= 0)
+        len += snprintf(buff + len, buff_len - len,
+            "  dc overlay: window %c, layer %d, %u flips\n",
+            pdev->dc_window >= 0 ? 'A' + pdev->dc_window : '-', pdev->dc_layer,
+            pdev->dc_flips);
+    if (len < buff_len && pdev->idle_running)
+        snprintf(buff + len, buff_len - len,
+            "  idle refresh: %s, %u idle periods, %llu ns per frame\n",
+            pdev->idle_active ? "active" : "inactive", pdev->idle_entries,
+            pdev->time_between_frames_ns);
 }
 
 static int tegra2_close(hw_device_t *device)
@@ -746,6 +2433,10 @@ static int tegra2_close(hw_device_t *device)
     struct tegra2_hwc_composer_device_1_t *pdev =
             (struct tegra2_hwc_composer_device_1_t *)device;
 
+    // Back to full rate before anything else goes away
+    idle_stop(pdev);
+    dc_overlay_close(pdev);
+
     // Stop VSYNC thread, if running
     if (pdev->vsync_running) {
         void * dummy;
@@ -758,8 +2449,10 @@ static int tegra2_close(hw_device_t *device)
         pthread_join(pdev->vsync_thread, &dummy);
     }
 
+    pthread_mutex_destroy(&pdev->profile_lock);
     pthread_mutex_destroy(&pdev->vsync_mutex);
     pthread_cond_destroy(&pdev->vsync_cond);
+    pthread_cond_destroy(&pdev->ref_cond);
 
     // Close NVidia host handle, if being used...
     if (pdev->nvhost_fd >= 0) {
@@ -775,6 +2468,13 @@ static int tegra2_close(hw_device_t *device)
 
     int ret = pdev->org->common.close( (hw_device_t *) pdev->org );
 
+    // Signal any fence still handed out before dropping the timeline
+    if (pdev->sync_timeline_fd >= 0) {
+        sw_sync_timeline_advance_to(pdev, pdev->sync_release_value + 1);
+        close(pdev->sync_timeline_fd);
+        pdev->sync_timeline_fd = -1;
+    }
+
     if (pdev->prepare_xlatebuf)
         free(pdev->prepare_xlatebuf);
     if (pdev->set_xlatebuf)
@@ -817,6 +2517,23 @@ static int tegra2_open(const struct hw_module_t *module, const char *name,
     dev->base.registerProcs = tegra2_registerProcs;
     dev->base.dump = tegra2_dump;
 
+    char property[PROPERTY_VALUE_MAX];
+    property_get("debug.hwc.prepare_cache", property, "0");
+    dev->prepare_cache = atoi(property) != 0;
+
+    // Fetch budget in bytes per output pixel; the default is window A plus
+    // two unscaled 32 bpp windows
+    property_get("debug.hwc.planner", property, "0");
+    dev->planner = atoi(property) != 0;
+    property_get("debug.hwc.planner_fetch", property, "12");
+    dev->planner_fetch_budget = atoi(property) * 16;
+
+    property_get("debug.hwc.profile", property, "0");
+    dev->profile = atoi(property) != 0;
+    pthread_mutex_init(&dev->profile_lock, NULL);
+
+    dev->sync_timeline_fd = sw_sync_timeline_open();
+
     dev->fb_fd = -1;
     struct fb_var_screeninfo info;
 
@@ -887,6 +2604,9 @@ static int tegra2_open(const struct hw_module_t *module, const char *name,
 
     pthread_mutex_init(&dev->vsync_mutex, NULL);
     pthread_cond_init(&dev->vsync_cond, NULL);
+    pthread_cond_init(&dev->ref_cond, NULL);
+
+    idle_init(dev);
 
     // Find out if we can use the NVidia VBLANK0 syncpoint to get VSYNC
     //  interrupts, or we must completely emulate them...
@@ -907,14 +2627,25 @@ static int tegra2_open(const struct hw_module_t *module, const char *name,
 
     } else {
 
-        ALOGD("Emulating VSYNC interrupts using nanosleep and kernel timers");
+        ALOGD("Emulating VSYNC interrupts using timerfd deadlines");
 
+        dev->vsync_emulated = true;
         dev->vsync_running = true;
         if (pthread_create(&dev->vsync_thread, NULL, tegra2_hwc_emulated_vsync_thread, dev)) {
             ALOGE("Unable to start VSYNC emulation thread");
         }
     }
 
+    if (hw_get_module(GRALLOC_HARDWARE_MODULE_ID, (const hw_module_t **)&dev->gralloc))
+        ALOGE("Unable to load gralloc, no DC overlay");
+
+    // Video layers on a DC0 window, needs gralloc to read the YUV layout
+    dev->dc_fd = dev->nvmap_fd = -1;
+    if (dev->gralloc)
+        dc_overlay_open(dev);
+    else
+        dev->dc_window = dev->dc_layer = -1;
+
     *device = &dev->base.common;
 
     return 0;
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWC_XLATE_H
+#define HWC_XLATE_H
+
+/*
+ * Translation between the HWC 1.x display contents SurfaceFlinger hands us
+ * and the HWC 0.x layer list the vendor module understands.
+ *
+ * hwc_layer_1_t starts with exactly the fields of hwc_layer_t, so a layer
+ * translates as one block of sizeof(hwc_layer_t) bytes (64 on ARM). Every
+ * layer is copied on every call: comparing a block first reads as much as
+ * copying it. Only the fields the vendor prepare() may change are copied
+ * back.
+ *
+ * The block copy is picked at compile time:
+ *  - VFP        ARMv7 with VFP (Tegra 2 is VFPv3-D16, it has no NEON)
+ *  - SSE2       x86 host builds
+ *  - generic    everything else, or when HWC_XLATE_GENERIC is defined
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(HWC_XLATE_GENERIC) && defined(__arm__) && defined(__VFP_FP__) && \
+        !defined(__SOFTFP__)
+#define HWC_XLATE_VFP
+#elif !defined(HWC_XLATE_GENERIC) && defined(__SSE2__)
+#define HWC_XLATE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(HWC_XLATE_VFP)
+static_assert(sizeof(hwc_layer_t) == 64, "hwc_layer_t is expected to be 64 bytes on ARM");
+#endif
+
+static inline const char *hwc_xlate_variant(void)
+{
+#if defined(HWC_XLATE_VFP)
+    return "vfp";
+#elif defined(HWC_XLATE_SSE2)
+    return "sse2";
+#else
+    return "generic";
+#endif
+}
+
+static inline void hwc_xlate_layer_copy(void *dst, const void *src)
+{
+#if defined(HWC_XLATE_VFP)
+    __asm__ volatile(
+        "pld [%0, #64]\n"
+        "pld [%0, #96]\n"
+        "vldmia %0, {d0-d7}\n"
+        "vstmia %1, {d0-d7}\n"
+        : : "r" (src), "r" (dst)
+        : "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7", "memory");
+#elif defined(HWC_XLATE_SSE2)
+    const __m128i *s = (const __m128i *)src;
+    __m128i *d = (__m128i *)dst;
+    size_t i;
+
+    for (i = 0; i < sizeof(hwc_layer_t) / sizeof(__m128i); i++)
+        _mm_storeu_si128(d + i, _mm_loadu_si128(s + i));
+    if (sizeof(hwc_layer_t) % sizeof(__m128i))
+        memcpy(d + i, s + i, sizeof(hwc_layer_t) % sizeof(__m128i));
+#else
+    memcpy(dst, src, sizeof(hwc_layer_t));
+#endif
+}
+
+/* fill dst from src, returns the number of layers written */
+static inline size_t hwc_xlate_contents_to_list(hwc_layer_list_t *dst,
+                                                const hwc_display_contents_1_t *src)
+{
+    dst->flags = src->flags;
+    for (size_t i = 0; i < src->numHwLayers; i++)
+        hwc_xlate_layer_copy(&dst->hwLayers[i], &src->hwLayers[i]);
+    dst->numHwLayers = src->numHwLayers;
+
+    return src->numHwLayers;
+}
+
+/*
+ * Copy back what the vendor prepare() is allowed to change. Layer flags are
+ * input only, which also keeps flags the wrapper adds for the vendor module
+ * away from SurfaceFlinger.
+ */
+static inline void hwc_xlate_list_to_contents(hwc_display_contents_1_t *dst,
+                                              const hwc_layer_list_t *src)
+{
+    for (size_t i = 0; i < dst->numHwLayers; i++) {
+        dst->hwLayers[i].compositionType = src->hwLayers[i].compositionType;
+        dst->hwLayers[i].hints = src->hwLayers[i].hints;
+    }
+}
+
+#endif /* HWC_XLATE_H */
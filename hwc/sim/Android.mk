@@ -0,0 +1,71 @@
+# Copyright (C) 2016 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Host side simulation of the Tegra 2 display stack for hwcomposer.tegra,
+# see README. Everything is 32 bit, like the vendor module and the device.
+
+LOCAL_PATH:= $(call my-dir)
+
+# Fake nvhost-ctrl, tegra_dc0, fb0 and sw_sync for LD_PRELOAD
+include $(CLEAR_VARS)
+LOCAL_MODULE := libhwcsim_preload
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MULTILIB := 32
+LOCAL_SRC_FILES := hwcsim_preload.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_CFLAGS += -Werror -Wall
+LOCAL_LDLIBS := -ldl -lpthread -lrt
+include $(BUILD_HOST_SHARED_LIBRARY)
+
+# Stub vendor HWC v0 module
+include $(CLEAR_VARS)
+LOCAL_MODULE := hwcomposer.tegra_v0-sim
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MULTILIB := 32
+LOCAL_SRC_FILES := hwcsim_vendor.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_CFLAGS += -Werror -Wall
+LOCAL_LDLIBS := -lrt
+include $(BUILD_HOST_SHARED_LIBRARY)
+
+# The wrapper, built for the host
+include $(CLEAR_VARS)
+LOCAL_MODULE := hwcomposer.tegra-sim
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MULTILIB := 32
+LOCAL_SRC_FILES := ../hwc_tegra2.cpp hwcsim_android.cpp
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/include $(LOCAL_PATH)/..
+LOCAL_CFLAGS += -Werror -Wall -include $(LOCAL_PATH)/hwcsim_host.h
+
+ifeq ($(BOARD_HAVE_SAMSUNG_T20_HWCOMPOSER),true)
+	LOCAL_CFLAGS += -DSAMSUNG_T20_HWCOMPOSER
+endif
+
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_LDLIBS := -ldl -lpthread -lrt
+include $(BUILD_HOST_SHARED_LIBRARY)
+
+# Driver
+include $(CLEAR_VARS)
+LOCAL_MODULE := hwcsim
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_MULTILIB := 32
+LOCAL_SRC_FILES := hwcsim.cpp
+LOCAL_CFLAGS += -Werror -Wall
+LOCAL_LDLIBS := -ldl -lpthread -lrt
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Drives the host build of the hwcomposer wrapper the way SurfaceFlinger
+ * does: VSYNC on, then one prepare()/set() per VSYNC callback. At the end it
+ * prints the jitter of the VSYNC timestamps, how late the callbacks arrive,
+ * what prepare() and set() cost and whether the release fences signalled,
+ * neither before the next frame is scanned out nor too late.
+ *
+ * Run it with libhwcsim_preload.so in LD_PRELOAD, see README.
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/hardware.h>
+#include <hardware/hwcomposer.h>
+
+#define DEFAULT_MODULE      "hwcomposer.tegra-sim.so"
+#define RELEASE_DEPTH       3       // frames a release fence gets to signal
+#define DUMP_SIZE           16384
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t count;
+    std::vector<int64_t> timestamps;
+    std::vector<int64_t> arrivals;
+} vsync = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    0,
+    std::vector<int64_t>(),
+    std::vector<int64_t>(),
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void hook_invalidate(const struct hwc_procs *)
+{
+}
+
+static void hook_vsync(const struct hwc_procs *, int disp, int64_t timestamp)
+{
+    int64_t arrival = now_ns();
+
+    if (disp != HWC_DISPLAY_PRIMARY)
+        return;
+
+    pthread_mutex_lock(&vsync.lock);
+    vsync.timestamps.push_back(timestamp);
+    vsync.arrivals.push_back(arrival);
+    vsync.count++;
+    pthread_cond_signal(&vsync.cond);
+    pthread_mutex_unlock(&vsync.lock);
+}
+
+static void hook_hotplug(const struct hwc_procs *, int disp, int connected)
+{
+    printf("hotplug: display %d %s\n", disp, connected ? "connected" : "disconnected");
+}
+
+static const hwc_procs_t procs = {
+    hook_invalidate,
+    hook_vsync,
+    hook_hotplug,
+};
+
+static bool wait_vsync(uint64_t *seen)
+{
+    struct timespec deadline;
+    bool ok = true;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&vsync.lock);
+    while (vsync.count == *seen && ok)
+        ok = pthread_cond_timedwait(&vsync.cond, &vsync.lock, &deadline) == 0;
+    *seen = vsync.count;
+    pthread_mutex_unlock(&vsync.lock);
+
+    return ok;
+}
+
+// p50/p99/max of a set of samples in us
+static void print_stats(const char *name, std::vector<int64_t> v)
+{
+    if (v.empty()) {
+        printf("  %-22s no samples\n", name);
+        return;
+    }
+
+    std::sort(v.begin(), v.end());
+    printf("  %-22s p50 %8.1f  p99 %8.1f  max %8.1f us (%zu samples)\n", name,
+        v[v.size() / 2] / 1000.0, v[v.size() * 99 / 100] / 1000.0,
+        v.back() / 1000.0, v.size());
+}
+
+static void setup_layers(hwc_display_contents_1_t *list, size_t num_layers,
+        const native_handle_t *buffers, unsigned int frame, bool geometry)
+{
+    static const hwc_rect_t frames[] = {
+        { 0,    0, 1280,  800 },    // wallpaper
+        { 0,   48, 1280,  752 },    // application
+        { 0,    0, 1280,   48 },    // status bar
+        { 0,  752, 1280,  800 },    // navigation bar
+        { 320, 200, 960,  600 },    // dialog
+    };
+
+    list->retireFenceFd = -1;
+    list->dpy = (hwc_display_t)1;
+    list->sur = (hwc_surface_t)1;
+    list->flags = geometry ? HWC_GEOMETRY_CHANGED : 0;
+    list->numHwLayers = num_layers;
+
+    for (size_t i = 0; i < num_layers; i++) {
+        hwc_layer_1_t *layer = &list->hwLayers[i];
+        const hwc_rect_t &r = frames[i % (sizeof(frames) / sizeof(frames[0]))];
+
+        if (geometry) {
+            memset(layer, 0, sizeof(*layer));
+            layer->compositionType = HWC_FRAMEBUFFER;
+            layer->blending = i ? HWC_BLENDING_PREMULT : HWC_BLENDING_NONE;
+            hwc_rect_t crop = { 0, 0, r.right - r.left, r.bottom - r.top };
+            layer->sourceCrop = crop;
+            layer->displayFrame = r;
+            layer->visibleRegionScreen.numRects = 1;
+            layer->visibleRegionScreen.rects = &layer->displayFrame;
+            layer->planeAlpha = 0xff;
+        }
+
+        // Every layer but the wallpaper gets a new buffer each frame
+        layer->handle = &buffers[i ? (frame + i) % 3 : 0];
+        layer->acquireFenceFd = -1;
+        layer->releaseFenceFd = -1;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [-m module] [-n frames] [-l layers] [-g frames] [-i frame] [-d]\n"
+        "  -m  wrapper module to load (" DEFAULT_MODULE ")\n"
+        "  -n  frames to run (600)\n"
+        "  -l  layers per frame (4)\n"
+        "  -g  flag a geometry change every this many frames (0, first frame only)\n"
+        "  -i  keep the same buffers from this frame on, an idle screen\n"
+        "  -d  print the wrapper dump at the end\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *module_path = DEFAULT_MODULE;
+    unsigned int frames = 600, geometry_interval = 0, idle_frame = UINT_MAX;
+    size_t num_layers = 4;
+    bool dump = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:n:l:g:i:dh")) != -1) {
+        switch (opt) {
+        case 'm': module_path = optarg; break;
+        case 'n': frames = strtoul(optarg, NULL, 0); break;
+        case 'l': num_layers = strtoul(optarg, NULL, 0); break;
+        case 'g': geometry_interval = strtoul(optarg, NULL, 0); break;
+        case 'i': idle_frame = strtoul(optarg, NULL, 0); break;
+        case 'd': dump = true; break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (!num_layers || num_layers > 32) {
+        fprintf(stderr, "layers must be 1 to 32\n");
+        return 2;
+    }
+
+    void *handle = dlopen(module_path, RTLD_NOW);
+    if (!handle) {
+        fprintf(stderr, "unable to load %s: %s\n", module_path, dlerror());
+        return 1;
+    }
+    hwc_module_t *module = (hwc_module_t *)dlsym(handle, HAL_MODULE_INFO_SYM_AS_STR);
+    if (!module) {
+        fprintf(stderr, "%s has no " HAL_MODULE_INFO_SYM_AS_STR "\n", module_path);
+        return 1;
+    }
+
+    hwc_composer_device_1_t *dev = NULL;
+    int ret = module->common.methods->open(&module->common, HWC_HARDWARE_COMPOSER,
+        (struct hw_device_t **)&dev);
+    if (ret) {
+        fprintf(stderr, "unable to open %s: %s\n", module->common.name, strerror(-ret));
+        return 1;
+    }
+
+    int period = 0;
+    dev->query(dev, HWC_VSYNC_PERIOD, &period);
+    printf("%s, VSYNC period %d ns, %u frames of %zu layers\n",
+        module->common.name, period, frames, num_layers);
+
+    dev->registerProcs(dev, &procs);
+    dev->eventControl(dev, HWC_DISPLAY_PRIMARY, HWC_EVENT_VSYNC, 1);
+
+    native_handle_t buffers[3];
+    memset(buffers, 0, sizeof(buffers));
+
+    hwc_display_contents_1_t *list = (hwc_display_contents_1_t *)calloc(1,
+        sizeof(*list) + num_layers * sizeof(hwc_layer_1_t));
+    std::vector<int64_t> prepare_ns, set_ns;
+    std::vector<int> release[RELEASE_DEPTH];
+    unsigned int missed_vsyncs = 0, unsignalled = 0, early = 0, fences = 0;
+    uint64_t seen = 0;
+
+    for (unsigned int frame = 0; frame < frames; frame++) {
+        if (!wait_vsync(&seen))
+            missed_vsyncs++;
+
+        bool geometry = frame == 0 ||
+            (geometry_interval && frame % geometry_interval == 0);
+        setup_layers(list, num_layers, buffers, std::min(frame, idle_frame), geometry);
+
+        int64_t t0 = now_ns();
+        dev->prepare(dev, 1, &list);
+        int64_t t1 = now_ns();
+        dev->set(dev, 1, &list);
+        int64_t t2 = now_ns();
+
+        prepare_ns.push_back(t1 - t0);
+        set_ns.push_back(t2 - t1);
+
+        if (list->retireFenceFd >= 0)
+            close(list->retireFenceFd);
+
+        // The previous frame is still scanned out until the next VSYNC
+        std::vector<int> &prev = release[(frame + RELEASE_DEPTH - 1) % RELEASE_DEPTH];
+        for (size_t i = 0; i < prev.size(); i++) {
+            struct pollfd pfd = { prev[i], POLLIN, 0 };
+            if (poll(&pfd, 1, 0) == 1)
+                early++;
+        }
+
+        // Fences from RELEASE_DEPTH frames ago must have signalled by now
+        std::vector<int> &old = release[frame % RELEASE_DEPTH];
+        for (size_t i = 0; i < old.size(); i++) {
+            struct pollfd pfd = { old[i], POLLIN, 0 };
+            if (poll(&pfd, 1, 0) != 1)
+                unsignalled++;
+            close(old[i]);
+        }
+        old.clear();
+        for (size_t i = 0; i < num_layers; i++) {
+            if (list->hwLayers[i].releaseFenceFd >= 0) {
+                old.push_back(list->hwLayers[i].releaseFenceFd);
+                fences++;
+            }
+        }
+    }
+
+    dev->eventControl(dev, HWC_DISPLAY_PRIMARY, HWC_EVENT_VSYNC, 0);
+
+    if (dump) {
+        char *buff = (char *)calloc(1, DUMP_SIZE);
+        dev->dump(dev, buff, DUMP_SIZE);
+        printf("%s\n", buff);
+        free(buff);
+    }
+
+    dev->common.close(&dev->common);
+    for (unsigned int i = 0; i < RELEASE_DEPTH; i++) {
+        for (size_t j = 0; j < release[i].size(); j++)
+            close(release[i][j]);
+    }
+    free(list);
+
+    // VSYNC jitter: deviation of each interval from the median one, which
+    // is the real refresh period when the panel runs off nominal
+    std::vector<int64_t> intervals, jitter, latency;
+    pthread_mutex_lock(&vsync.lock);
+    for (size_t i = 1; i < vsync.timestamps.size(); i++)
+        intervals.push_back(vsync.timestamps[i] - vsync.timestamps[i - 1]);
+    if (!intervals.empty()) {
+        std::vector<int64_t> sorted(intervals);
+        std::sort(sorted.begin(), sorted.end());
+        int64_t median = sorted[sorted.size() / 2];
+        printf("measured VSYNC period %lld ns\n", (long long)median);
+        for (size_t i = 0; i < intervals.size(); i++) {
+            int64_t delta = intervals[i] - median;
+            jitter.push_back(delta < 0 ? -delta : delta);
+        }
+    }
+    for (size_t i = 0; i < vsync.arrivals.size(); i++)
+        latency.push_back(vsync.arrivals[i] - vsync.timestamps[i]);
+
+    // Offset from the simulated panel, over the second half of the run so
+    // the emulated VSYNC has had time to lock
+    std::vector<int64_t> phase;
+    int64_t (*vblank_offset)(int64_t) =
+        (int64_t (*)(int64_t))dlsym(RTLD_DEFAULT, "hwcsim_vblank_offset");
+    for (size_t i = vsync.timestamps.size() / 2; vblank_offset && i < vsync.timestamps.size();
+            i++) {
+        int64_t offset = vblank_offset(vsync.timestamps[i]);
+        phase.push_back(offset < 0 ? -offset : offset);
+    }
+    pthread_mutex_unlock(&vsync.lock);
+
+    printf("results:\n");
+    print_stats("vsync interval error", jitter);
+    print_stats("vsync delivery", latency);
+    if (!phase.empty())
+        print_stats("vsync phase error", phase);
+    print_stats("prepare", prepare_ns);
+    print_stats("set", set_ns);
+    printf("  %u frames without a VSYNC, %u of %u release fences early, %u late\n",
+        missed_vsyncs, early, fences, unsignalled);
+
+    return missed_vsyncs == frames ? 1 : 0;
+}
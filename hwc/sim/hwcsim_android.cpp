@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host versions of the platform calls the wrapper makes. Properties are read
+ * from the environment (env debug.hwc.profile=1 hwcsim ...) and there is no
+ * gralloc, so the DC overlay path is not simulated.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <cutils/properties.h>
+#include <hardware/hardware.h>
+
+#include "hwcsim_host.h"
+
+extern "C" int property_get(const char *key, char *value, const char *default_value)
+{
+    const char *env = getenv(key);
+
+    if (!env)
+        env = default_value ? default_value : "";
+
+    strncpy(value, env, PROPERTY_VALUE_MAX - 1);
+    value[PROPERTY_VALUE_MAX - 1] = '\0';
+    return strlen(value);
+}
+
+extern "C" int hw_get_module(const char *id __attribute__((unused)),
+        const struct hw_module_t **module)
+{
+    *module = NULL;
+    return -ENOENT;
+}
+
+// Real time priorities need root; without them the VSYNC threads just run
+// at normal priority, which is part of what the harness measures
+extern "C" int androidSetThreadPriority(pid_t tid, int prio)
+{
+    setpriority(PRIO_PROCESS, tid, prio);
+    return 0;
+}
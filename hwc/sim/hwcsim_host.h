@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWCSIM_HOST_H
+#define HWCSIM_HOST_H
+
+/*
+ * Force-included into the host build of hwc_tegra2.cpp for what the device
+ * build gets from bionic and from the Android-only parts of the platform
+ * headers. hwcsim_android.cpp implements the functions.
+ */
+
+#include <linux/fb.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int androidSetThreadPriority(pid_t tid, int prio);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HWCSIM_HOST_H */
@@ -0,0 +1,592 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * LD_PRELOAD interposer that stands in for the Tegra 2 display devices the
+ * hwcomposer wrapper talks to:
+ *
+ *  /dev/nvhost-ctrl     VBLANK0 syncpoint, incremented once per refresh
+ *  /dev/tegra_dc0       TEGRA_DC_EXT_GET_VBLANK_SYNCPT
+ *  /dev/graphics/fb0    mode, FBIO_WAITFORVSYNC and a mappable framebuffer
+ *  /dev/sw_sync         timelines whose fences are eventfds
+ *
+ * and redirects the dlopen() of the vendor hwcomposer.tegra_v0.so to the
+ * stub module. Configuration comes from the environment:
+ *
+ *  HWCSIM_REFRESH_HZ    nominal refresh rate, default 60
+ *  HWCSIM_DRIFT_PPM     how far the simulated panel runs off nominal, default 0
+ *  HWCSIM_JITTER_US     maximum interrupt latency, default 0
+ *  HWCSIM_WAIT          "waitex" to hide NVHOST_IOCTL_CTRL_SYNCPT_WAITMEX,
+ *                       "none" to hide /dev/nvhost-ctrl for emulated VSYNC
+ *  HWCSIM_VENDOR        path of the stub vendor module
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/fb.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+#include <linux/nvhost_ioctl.h>
+#include <linux/sw_sync.h>
+#include <video/tegra_dc_ext.h>
+
+#define SIM_VBLANK_SYNCPT       26      /* NVSYNCPT_VBLANK0 */
+#define SIM_SYNCPT_BASE         1000    /* syncpoint value at start up */
+#define SIM_MAX_FDS             64
+#define SIM_MAX_FENCES          256
+
+#define SIM_VENDOR_NAME         "hwcomposer.tegra_v0.so"
+#define SIM_VENDOR_DEFAULT      "hwcomposer.tegra_v0-sim.so"
+
+/* P4 panel: 1280x800, 217 x 136 mm */
+#define SIM_XRES                1280
+#define SIM_YRES                800
+#define SIM_WIDTH_MM            217
+#define SIM_HEIGHT_MM           136
+
+enum sim_dev {
+    SIM_NONE,
+    SIM_NVHOST,
+    SIM_DC0,
+    SIM_FB0,
+    SIM_SW_SYNC,
+};
+
+struct sim_fence {
+    int fd;                             /* private dup of the eventfd */
+    uint32_t value;
+};
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t lock;
+
+    int (*real_open)(const char *, int, ...);
+    int (*real_close)(int);
+    int (*real_ioctl)(int, unsigned long, ...);
+    void *(*real_dlopen)(const char *, int);
+
+    enum sim_dev fds[SIM_MAX_FDS];
+
+    /* display timing, vblank n is at t0 + (n - n0) * period */
+    struct fb_var_screeninfo var;
+    int64_t t0;
+    int64_t n0;
+    int64_t period_ns;
+    int64_t jitter_ns;
+    double drift;
+    int waitmex;
+    int nvhost;
+
+    /* one sw_sync timeline is all the wrapper uses */
+    uint32_t timeline;
+    struct sim_fence fences[SIM_MAX_FENCES];
+    int num_fences;
+} sim = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int64_t sim_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sim_sleep_until(int64_t t)
+{
+    struct timespec ts = {
+        .tv_sec = t / 1000000000LL,
+        .tv_nsec = t % 1000000000LL,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int64_t sim_env(const char *name, int64_t def)
+{
+    const char *value = getenv(name);
+    return value && value[0] ? strtoll(value, NULL, 0) : def;
+}
+
+/* Frame time of the current mode in ns, the way the wrapper computes it */
+static int64_t sim_mode_period(const struct fb_var_screeninfo *var)
+{
+    return (int64_t)(var->upper_margin + var->lower_margin + var->vsync_len + var->yres)
+        * (var->left_margin + var->right_margin + var->hsync_len + var->xres)
+        * var->pixclock / 1000;
+}
+
+/* Called with sim.lock held */
+static void sim_set_mode(const struct fb_var_screeninfo *var)
+{
+    int64_t now = sim_now();
+
+    /* keep counting vblanks from the last one of the old mode */
+    if (sim.period_ns) {
+        sim.n0 += (now - sim.t0) / sim.period_ns;
+        sim.t0 += (now - sim.t0) / sim.period_ns * sim.period_ns;
+    } else {
+        sim.n0 = SIM_SYNCPT_BASE;
+        sim.t0 = now;
+    }
+
+    sim.var = *var;
+    sim.period_ns = (int64_t)(sim_mode_period(var) * (1.0 + sim.drift));
+    if (sim.period_ns <= 0)
+        sim.period_ns = 16666667;
+}
+
+static void sim_init(void)
+{
+    struct fb_var_screeninfo var;
+    int64_t hz = sim_env("HWCSIM_REFRESH_HZ", 60);
+    const char *wait = getenv("HWCSIM_WAIT");
+
+    sim.real_open = dlsym(RTLD_NEXT, "open");
+    sim.real_close = dlsym(RTLD_NEXT, "close");
+    sim.real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    sim.real_dlopen = dlsym(RTLD_NEXT, "dlopen");
+
+    if (hz <= 0)
+        hz = 60;
+    sim.drift = sim_env("HWCSIM_DRIFT_PPM", 0) / 1e6;
+    sim.jitter_ns = sim_env("HWCSIM_JITTER_US", 0) * 1000;
+    if (sim.jitter_ns < 0)
+        sim.jitter_ns = 0;
+    sim.waitmex = !wait || (strcmp(wait, "waitex") && strcmp(wait, "none"));
+    sim.nvhost = !wait || strcmp(wait, "none");
+
+    memset(&var, 0, sizeof(var));
+    var.xres = var.xres_virtual = SIM_XRES;
+    var.yres = SIM_YRES;
+    var.yres_virtual = SIM_YRES * 2;
+    var.bits_per_pixel = 32;
+    var.width = SIM_WIDTH_MM;
+    var.height = SIM_HEIGHT_MM;
+    var.left_margin = 32;
+    var.right_margin = 48;
+    var.hsync_len = 80;
+    var.upper_margin = 6;
+    var.lower_margin = 3;
+    var.vsync_len = 14;
+    var.pixclock = (uint32_t)(1000000000000LL /
+        ((int64_t)(SIM_XRES + 160) * (SIM_YRES + 23) * hz));
+
+    pthread_mutex_lock(&sim.lock);
+    sim_set_mode(&var);
+    /* interrupts must stay in order */
+    if (sim.jitter_ns > sim.period_ns / 2)
+        sim.jitter_ns = sim.period_ns / 2;
+    pthread_mutex_unlock(&sim.lock);
+
+    fprintf(stderr, "hwcsim: %ux%u, frame %lld ns, drift %lld ppm, jitter %lld us, %s\n",
+        var.xres, var.yres, (long long)sim.period_ns,
+        (long long)sim_env("HWCSIM_DRIFT_PPM", 0), (long long)sim.jitter_ns / 1000,
+        !sim.nvhost ? "no nvhost" : sim.waitmex ? "waitmex" : "waitex only");
+}
+
+static inline void sim_once(void)
+{
+    pthread_once(&sim.once, sim_init);
+}
+
+/*
+ * Interrupt latency of vblank n. A hash of n rather than rand(), so every
+ * reader sees the same interrupt time for the same vblank.
+ */
+static int64_t sim_jitter(int64_t n)
+{
+    uint32_t x = (uint32_t)n * 2654435761u;
+
+    if (!sim.jitter_ns)
+        return 0;
+    x ^= x >> 15;
+    x *= 2246822519u;
+    x ^= x >> 13;
+    return (int64_t)(x % (uint32_t)sim.jitter_ns);
+}
+
+/* When the interrupt for vblank n fires. Called with sim.lock held */
+static int64_t sim_irq_time(int64_t n)
+{
+    return sim.t0 + (n - sim.n0) * sim.period_ns + sim_jitter(n);
+}
+
+/* Syncpoint value at time t: the last vblank whose interrupt has fired */
+static int64_t sim_syncpt_at(int64_t t)
+{
+    int64_t n = sim.n0 + (t - sim.t0) / sim.period_ns;
+
+    if (t < sim_irq_time(n))
+        n--;
+    return n;
+}
+
+static int sim_wait_syncpt(uint32_t id, uint32_t thresh, int32_t timeout,
+                           uint32_t *value, int64_t *ts)
+{
+    int64_t now, irq, cur, n;
+
+    if (id != SIM_VBLANK_SYNCPT)
+        return -EINVAL;
+
+    pthread_mutex_lock(&sim.lock);
+    now = sim_now();
+    cur = sim_syncpt_at(now);
+    /* the vblank that brings the syncpoint to thresh, 32 bit wrap safe */
+    n = cur + (int32_t)(thresh - (uint32_t)cur);
+    irq = sim_irq_time(n);
+    pthread_mutex_unlock(&sim.lock);
+
+    if (n <= cur) {
+        *value = (uint32_t)cur;
+        *ts = now;
+        return 0;
+    }
+
+    if (timeout == 0)
+        return -EAGAIN;
+    if (timeout > 0 && now + timeout * 1000000LL < irq) {
+        sim_sleep_until(now + timeout * 1000000LL);
+        return -EAGAIN;
+    }
+
+    sim_sleep_until(irq);
+    *value = (uint32_t)n;
+    *ts = irq;
+    return 0;
+}
+
+static int sim_nvhost_ioctl(unsigned long request, void *arg)
+{
+    int64_t ts;
+    int ret;
+
+    switch (request) {
+    case NVHOST_IOCTL_CTRL_SYNCPT_READ: {
+        struct nvhost_ctrl_syncpt_read_args *ra = arg;
+        if (ra->id != SIM_VBLANK_SYNCPT)
+            return -EINVAL;
+        pthread_mutex_lock(&sim.lock);
+        ra->value = (uint32_t)sim_syncpt_at(sim_now());
+        pthread_mutex_unlock(&sim.lock);
+        return 0;
+    }
+    case NVHOST_IOCTL_CTRL_SYNCPT_WAITEX: {
+        struct nvhost_ctrl_syncpt_waitex_args *wa = arg;
+        return sim_wait_syncpt(wa->id, wa->thresh, wa->timeout, &wa->value, &ts);
+    }
+    case NVHOST_IOCTL_CTRL_SYNCPT_WAITMEX: {
+        struct nvhost_ctrl_syncpt_waitmex_args *wa = arg;
+        if (!sim.waitmex)
+            return -ENOTTY;
+        ret = sim_wait_syncpt(wa->id, wa->thresh, wa->timeout, &wa->value, &ts);
+        if (ret == 0) {
+            wa->tv_sec = (uint32_t)(ts / 1000000000LL);
+            wa->tv_nsec = (uint32_t)(ts % 1000000000LL);
+        }
+        return ret;
+    }
+    case NVHOST_IOCTL_CTRL_GET_VERSION:
+        ((struct nvhost_get_param_args *)arg)->value = NVHOST_SUBMIT_VERSION_V2;
+        return 0;
+    }
+
+    return -ENOTTY;
+}
+
+static int sim_fb_ioctl(unsigned long request, void *arg)
+{
+    switch (request) {
+    case FBIOGET_VSCREENINFO:
+        pthread_mutex_lock(&sim.lock);
+        *(struct fb_var_screeninfo *)arg = sim.var;
+        pthread_mutex_unlock(&sim.lock);
+        return 0;
+    case FBIOPUT_VSCREENINFO: {
+        struct fb_var_screeninfo *var = arg;
+        if (var->xres != SIM_XRES || var->yres != SIM_YRES || !var->pixclock)
+            return -EINVAL;
+        pthread_mutex_lock(&sim.lock);
+        sim_set_mode(var);
+        pthread_mutex_unlock(&sim.lock);
+        return 0;
+    }
+    case FBIOGET_FSCREENINFO: {
+        struct fb_fix_screeninfo *fix = arg;
+        memset(fix, 0, sizeof(*fix));
+        strcpy(fix->id, "hwcsim");
+        fix->line_length = SIM_XRES * 4;
+        fix->smem_len = fix->line_length * SIM_YRES * 2;
+        fix->visual = FB_VISUAL_TRUECOLOR;
+        return 0;
+    }
+    case FBIO_WAITFORVSYNC: {
+        int64_t irq;
+        pthread_mutex_lock(&sim.lock);
+        irq = sim_irq_time(sim_syncpt_at(sim_now()) + 1);
+        pthread_mutex_unlock(&sim.lock);
+        sim_sleep_until(irq);
+        return 0;
+    }
+    case FBIOBLANK:
+    case FBIOPAN_DISPLAY:
+        return 0;
+    }
+
+    return -ENOTTY;
+}
+
+/* Called with sim.lock held */
+static void sim_signal_fences(void)
+{
+    int i = 0;
+
+    while (i < sim.num_fences) {
+        struct sim_fence *f = &sim.fences[i];
+        if ((int32_t)(sim.timeline - f->value) >= 0) {
+            eventfd_write(f->fd, 1);
+            sim.real_close(f->fd);
+            *f = sim.fences[--sim.num_fences];
+        } else {
+            i++;
+        }
+    }
+}
+
+static int sim_sw_sync_ioctl(unsigned long request, void *arg)
+{
+    switch (request) {
+    case SW_SYNC_IOC_CREATE_FENCE: {
+        struct sw_sync_create_fence_data *data = arg;
+        int fd = eventfd(0, EFD_CLOEXEC);
+        if (fd < 0)
+            return -errno;
+
+        pthread_mutex_lock(&sim.lock);
+        if (sim.num_fences == SIM_MAX_FENCES) {
+            pthread_mutex_unlock(&sim.lock);
+            sim.real_close(fd);
+            return -ENOMEM;
+        }
+        /* the caller may close its fd before the fence signals */
+        sim.fences[sim.num_fences].fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        sim.fences[sim.num_fences].value = data->value;
+        sim.num_fences++;
+        sim_signal_fences();
+        pthread_mutex_unlock(&sim.lock);
+
+        data->fence = fd;
+        return 0;
+    }
+    case SW_SYNC_IOC_INC:
+        pthread_mutex_lock(&sim.lock);
+        sim.timeline += *(uint32_t *)arg;
+        sim_signal_fences();
+        pthread_mutex_unlock(&sim.lock);
+        return 0;
+    }
+
+    return -ENOTTY;
+}
+
+/* -- Interposed libc entry points */
+
+static enum sim_dev sim_lookup(int fd)
+{
+    enum sim_dev dev = SIM_NONE;
+
+    if (fd < 0 || fd >= SIM_MAX_FDS)
+        return SIM_NONE;
+    pthread_mutex_lock(&sim.lock);
+    dev = sim.fds[fd];
+    pthread_mutex_unlock(&sim.lock);
+    return dev;
+}
+
+static int sim_open(const char *path, int flags, mode_t mode)
+{
+    enum sim_dev dev = SIM_NONE;
+    int fd;
+
+    sim_once();
+
+    if (!strcmp(path, "/dev/nvhost-ctrl")) {
+        if (!sim.nvhost) {
+            errno = ENOENT;
+            return -1;
+        }
+        dev = SIM_NVHOST;
+    }
+    else if (!strcmp(path, "/dev/tegra_dc0"))
+        dev = SIM_DC0;
+    else if (!strcmp(path, "/dev/graphics/fb0"))
+        dev = SIM_FB0;
+    else if (!strcmp(path, "/dev/sw_sync"))
+        dev = SIM_SW_SYNC;
+    else
+        return sim.real_open(path, flags, mode);
+
+    if (dev == SIM_FB0) {
+        /* an unlinked file the size of the framebuffer, so mmap() just works */
+        char name[] = "/tmp/hwcsim-fb0-XXXXXX";
+        fd = mkostemp(name, O_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        unlink(name);
+        if (ftruncate(fd, SIM_XRES * 4 * SIM_YRES * 2) < 0) {
+            sim.real_close(fd);
+            return -1;
+        }
+    } else {
+        fd = sim.real_open("/dev/null", O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+    }
+
+    if (fd >= SIM_MAX_FDS) {
+        sim.real_close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    pthread_mutex_lock(&sim.lock);
+    sim.fds[fd] = dev;
+    pthread_mutex_unlock(&sim.lock);
+
+    return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+
+    if (flags & O_CREAT) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+    return sim_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int close(int fd)
+{
+    sim_once();
+
+    if (sim_lookup(fd) != SIM_NONE) {
+        pthread_mutex_lock(&sim.lock);
+        sim.fds[fd] = SIM_NONE;
+        pthread_mutex_unlock(&sim.lock);
+    }
+    return sim.real_close(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    enum sim_dev dev;
+    va_list ap;
+    void *arg;
+    int ret;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    sim_once();
+
+    dev = sim_lookup(fd);
+    switch (dev) {
+    case SIM_NVHOST:
+        ret = sim_nvhost_ioctl(request, arg);
+        break;
+    case SIM_DC0:
+        if (request != TEGRA_DC_EXT_GET_VBLANK_SYNCPT) {
+            ret = -ENOTTY;
+            break;
+        }
+        *(uint32_t *)arg = SIM_VBLANK_SYNCPT;
+        ret = 0;
+        break;
+    case SIM_FB0:
+        ret = sim_fb_ioctl(request, arg);
+        break;
+    case SIM_SW_SYNC:
+        ret = sim_sw_sync_ioctl(request, arg);
+        break;
+    default:
+        return sim.real_ioctl(fd, request, arg);
+    }
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+/*
+ * Distance from t to the closest simulated vblank, for hwcsim to check the
+ * VSYNC timestamps against the panel rather than against the interrupts.
+ */
+int64_t hwcsim_vblank_offset(int64_t t)
+{
+    int64_t d;
+
+    sim_once();
+
+    pthread_mutex_lock(&sim.lock);
+    d = (t - sim.t0) % sim.period_ns;
+    if (d < 0)
+        d += sim.period_ns;
+    if (d >= sim.period_ns / 2)
+        d -= sim.period_ns;
+    pthread_mutex_unlock(&sim.lock);
+
+    return d;
+}
+
+void *dlopen(const char *filename, int flags)
+{
+    size_t len, suffix = strlen(SIM_VENDOR_NAME);
+
+    sim_once();
+
+    len = filename ? strlen(filename) : 0;
+    if (len >= suffix && !strcmp(filename + len - suffix, SIM_VENDOR_NAME)) {
+        const char *vendor = getenv("HWCSIM_VENDOR");
+        filename = vendor && vendor[0] ? vendor : SIM_VENDOR_DEFAULT;
+    }
+
+    return sim.real_dlopen(filename, flags);
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Stand-in for the vendor hwcomposer.tegra_v0.so. It takes up to
+ * HWCSIM_VENDOR_OVERLAYS (default 1) layers as overlays, bottom up, and
+ * burns HWCSIM_VENDOR_PREPARE_US / HWCSIM_VENDOR_SET_US (default 0) of CPU
+ * in prepare() and set() to stand for the cost of the real module.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <hardware/hardware.h>
+#include <hardware/hwcomposer.h>
+
+#include "hwcomposer_v0.h"
+
+struct sim_vendor_device {
+    hwc_composer_device_t base;
+    unsigned int max_overlays;
+    long prepare_us;
+    long set_us;
+    unsigned long prepares;
+    unsigned long sets;
+    unsigned long overlays;
+};
+
+static long sim_vendor_env(const char *name, long def)
+{
+    const char *value = getenv(name);
+    return value && value[0] ? strtol(value, NULL, 0) : def;
+}
+
+static void sim_vendor_spin(long us)
+{
+    struct timespec start, now;
+
+    if (us <= 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000L +
+             (now.tv_nsec - start.tv_nsec) / 1000 < us);
+}
+
+static int sim_vendor_prepare(hwc_composer_device_t *dev, hwc_layer_list_t *list)
+{
+    struct sim_vendor_device *vdev = (struct sim_vendor_device *)dev;
+    unsigned int overlays = 0;
+    size_t i;
+
+    if (!list)
+        return 0;
+
+    for (i = 0; i < list->numHwLayers; i++) {
+        hwc_layer_t *layer = &list->hwLayers[i];
+
+        if (overlays < vdev->max_overlays && layer->handle &&
+                !(layer->flags & HWC_SKIP_LAYER)) {
+            layer->compositionType = HWC_OVERLAY;
+            overlays++;
+        } else {
+            layer->compositionType = HWC_FRAMEBUFFER;
+        }
+    }
+
+    vdev->prepares++;
+    vdev->overlays += overlays;
+    sim_vendor_spin(vdev->prepare_us);
+    return 0;
+}
+
+static int sim_vendor_set(hwc_composer_device_t *dev, hwc_display_t dpy,
+                          hwc_surface_t sur, hwc_layer_list_t *list)
+{
+    struct sim_vendor_device *vdev = (struct sim_vendor_device *)dev;
+
+    (void)dpy;
+    (void)sur;
+    (void)list;
+
+    vdev->sets++;
+    sim_vendor_spin(vdev->set_us);
+    return 0;
+}
+
+static void sim_vendor_dump(hwc_composer_device_t *dev, char *buff, int buff_len)
+{
+    struct sim_vendor_device *vdev = (struct sim_vendor_device *)dev;
+
+    snprintf(buff, buff_len, "hwcsim vendor module: %lu prepares, %lu sets, %lu overlays\n",
+        vdev->prepares, vdev->sets, vdev->overlays);
+}
+
+static void sim_vendor_registerProcs(hwc_composer_device_t *dev, hwc_procs_t const *procs)
+{
+    (void)dev;
+    (void)procs;
+}
+
+/* No VSYNC period and no methods: the wrapper works both out itself */
+static int sim_vendor_query(hwc_composer_device_t *dev, int what, int *value)
+{
+    (void)dev;
+    (void)what;
+    (void)value;
+    return -EINVAL;
+}
+
+static int sim_vendor_close(hw_device_t *dev)
+{
+    free(dev);
+    return 0;
+}
+
+static int sim_vendor_open(const hw_module_t *module, const char *name, hw_device_t **device)
+{
+    struct sim_vendor_device *vdev;
+
+    if (strcmp(name, HWC_HARDWARE_COMPOSER))
+        return -EINVAL;
+
+    vdev = calloc(1, sizeof(*vdev));
+    if (!vdev)
+        return -ENOMEM;
+
+    vdev->base.common.tag = HARDWARE_DEVICE_TAG;
+    vdev->base.common.version = HWC_DEVICE_API_VERSION_0_3;
+    vdev->base.common.module = (hw_module_t *)module;
+    vdev->base.common.close = sim_vendor_close;
+    vdev->base.prepare = sim_vendor_prepare;
+    vdev->base.set = sim_vendor_set;
+    vdev->base.dump = sim_vendor_dump;
+    vdev->base.registerProcs = sim_vendor_registerProcs;
+    vdev->base.query = sim_vendor_query;
+
+    vdev->max_overlays = sim_vendor_env("HWCSIM_VENDOR_OVERLAYS", 1);
+    vdev->prepare_us = sim_vendor_env("HWCSIM_VENDOR_PREPARE_US", 0);
+    vdev->set_us = sim_vendor_env("HWCSIM_VENDOR_SET_US", 0);
+
+    *device = &vdev->base.common;
+    return 0;
+}
+
+static struct hw_module_methods_t sim_vendor_module_methods = {
+    .open = sim_vendor_open,
+};
+
+hwc_module_t HAL_MODULE_INFO_SYM = {
+    .common = {
+        .tag = HARDWARE_MODULE_TAG,
+        .module_api_version = HWC_MODULE_API_VERSION_0_1,
+        .hal_api_version = HARDWARE_HAL_API_VERSION,
+        .id = HWC_HARDWARE_MODULE_ID,
+        .name = "hwcsim Tegra2 HWC v0 stub",
+        .author = "The Android Open Source Project",
+        .methods = &sim_vendor_module_methods,
+    }
+};
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWCSIM_EGL_H
+#define HWCSIM_EGL_H
+
+/*
+ * The wrapper only needs EGL_NO_DISPLAY and EGL_NO_SURFACE. The platform
+ * EGL headers pull in X11 on a Linux host, so the host build uses this.
+ */
+
+typedef void *EGLDisplay;
+typedef void *EGLSurface;
+
+#define EGL_NO_DISPLAY ((EGLDisplay)0)
+#define EGL_NO_SURFACE ((EGLSurface)0)
+
+#endif /* HWCSIM_EGL_H */
@@ -6,7 +6,7 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := audio.primary.tegra
 LOCAL_MODULE_RELATIVE_PATH := hw
-LOCAL_SRC_FILES := audio_hw.c
+LOCAL_SRC_FILES := audio_hw.c audio_dsp.c
 LOCAL_C_INCLUDES += \
 	external/tinyalsa/include \
 	$(call include-path-for, audio-utils) \
@@ -22,4 +22,57 @@ LOCAL_CLANG := true
 
 include $(BUILD_SHARED_LIBRARY)
 
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_calibrate
+LOCAL_SRC_FILES := audio_calibrate.c
+LOCAL_C_INCLUDES += external/tinyalsa/include
+LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS += -Werror -Wall
+
+LOCAL_CLANG := true
+
+include $(BUILD_EXECUTABLE)
+
+# Speaker EQ effect, processed by audio.primary.tegra
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libspeakereq
+LOCAL_MODULE_RELATIVE_PATH := soundfx
+LOCAL_SRC_FILES := audio_effect_spkeq.c
+LOCAL_C_INCLUDES += $(call include-path-for, audio-effects)
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS += -Werror -Wall
+LOCAL_CFLAGS += -Wno-unused-parameter
+LOCAL_CFLAGS += -fvisibility=hidden
+
+LOCAL_CLANG := true
+
+include $(BUILD_SHARED_LIBRARY)
+
+# Benchmark of the gain path in audio_dsp.c, for the device and the host
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_dsp_bench
+LOCAL_SRC_FILES := audio_dsp_bench.c audio_dsp.c
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS += -Werror -Wall
+
+LOCAL_CLANG := true
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_dsp_bench
+LOCAL_SRC_FILES := audio_dsp_bench.c audio_dsp.c
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_HOST_OS := linux
+LOCAL_CFLAGS += -Werror -Wall
+LOCAL_LDLIBS := -lm -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
 endif
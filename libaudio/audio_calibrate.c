@@ -0,0 +1,450 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Round trip latency calibration for audio.primary.tegra.
+ *
+ * For every candidate period size / period count the tool plays a train of
+ * impulses on the route's playback PCM, captures them back through a
+ * loopback (speaker to mic, loopback plug or BT headset in echo mode), and
+ * measures the round trip latency and the number of xruns. The lowest
+ * latency glitch free candidate is written to the route profile file read
+ * by the HAL at adev_open().
+ *
+ * The media server must be stopped while calibrating, as the PCMs are opened
+ * exclusively.
+ */
+
+#define LOG_TAG "audio_calibrate"
+// #define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <tinyalsa/asoundlib.h>
+
+#define PCM_CARD 0
+#define PCM_DEVICE 0
+#define PCM_DEVICE_VOICE 2
+
+#define MIXER_CARD 0
+
+#define PROFILE_FILE "/data/misc/audio/audio_hw_tegra.conf"
+#define PROFILE_MAX_LINES 64
+#define PROFILE_LINE_LEN 128
+
+#define NUM_IMPULSES 5
+#define IMPULSE_INTERVAL_MS 400
+#define IMPULSE_LEN 16
+#define IMPULSE_AMPLITUDE 30000
+#define DETECT_MIN_LEVEL 2000 /* absolute floor for the impulse detector */
+#define DETECT_NOISE_RATIO 8  /* impulse must exceed the noise floor by this */
+
+struct route {
+    const char *name;
+    unsigned int device;
+    unsigned int rate;
+    unsigned int channels;
+    const char *playback_path;
+    const char *capture_path;
+};
+
+static const struct route routes[] = {
+    { "spk", PCM_DEVICE, 44100, 2, "SPK", "Main Mic" },
+    { "hs", PCM_DEVICE, 44100, 2, "HP", "Hands Free Mic" },
+    { "bt", PCM_DEVICE_VOICE, 8000, 1, "BT", "BT Sco Mic" },
+};
+
+static const unsigned int candidate_periods[] = { 256, 512, 768, 1024 };
+static const unsigned int candidate_counts[] = { 2, 3, 4 };
+
+struct result {
+    unsigned int period_size;
+    unsigned int period_count;
+    int latency_frames;     /* median round trip, -1 if nothing was detected */
+    unsigned int detected;
+    unsigned int glitches;
+    float seconds;
+};
+
+static void set_route(const struct route *route)
+{
+    struct mixer *mixer = mixer_open(MIXER_CARD);
+    struct mixer_ctl *ctl;
+
+    if (mixer == NULL) {
+        fprintf(stderr, "cannot open mixer\n");
+        return;
+    }
+
+    ctl = mixer_get_ctl_by_name(mixer, "Playback Path");
+    if (ctl)
+        mixer_ctl_set_enum_by_string(ctl, route->playback_path);
+    ctl = mixer_get_ctl_by_name(mixer, "Capture MIC Path");
+    if (ctl)
+        mixer_ctl_set_enum_by_string(ctl, route->capture_path);
+
+    mixer_close(mixer);
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* first frame of the left channel at or above the threshold, -1 if none */
+static int find_onset(const int16_t *buf, unsigned int frames, unsigned int channels,
+                      int threshold)
+{
+    unsigned int i;
+
+    for (i = 0; i < frames; i++) {
+        int s = buf[i * channels];
+        if (s < 0)
+            s = -s;
+        if (s >= threshold)
+            return i;
+    }
+    return -1;
+}
+
+/* peak level of the left channel */
+static int noise_level(const int16_t *buf, unsigned int frames, unsigned int channels)
+{
+    unsigned int i;
+    int peak = 0;
+
+    for (i = 0; i < frames; i++) {
+        int s = buf[i * channels];
+        if (s < 0)
+            s = -s;
+        if (s > peak)
+            peak = s;
+    }
+    return peak;
+}
+
+static int measure(const struct route *route, unsigned int period_size,
+                   unsigned int period_count, struct result *result)
+{
+    struct pcm_config config;
+    struct pcm *out, *in;
+    int16_t *play, *rec;
+    size_t period_bytes;
+    unsigned int interval = route->rate * IMPULSE_INTERVAL_MS / 1000;
+    unsigned int total = interval * (NUM_IMPULSES + 1);
+    unsigned long long written = 0, captured = 0;
+    unsigned long long next_impulse = interval;
+    unsigned long long impulse_pos[NUM_IMPULSES];
+    int latencies[NUM_IMPULSES];
+    unsigned int sent = 0, found = 0;
+    int noise = 0;
+    unsigned int i;
+
+    memset(&config, 0, sizeof(config));
+    config.channels = route->channels;
+    config.rate = route->rate;
+    config.period_size = period_size;
+    config.period_count = period_count;
+    config.format = PCM_FORMAT_S16_LE;
+    config.start_threshold = period_size;
+
+    out = pcm_open(PCM_CARD, route->device, PCM_OUT | PCM_NORESTART | PCM_MONOTONIC, &config);
+    if (!out || !pcm_is_ready(out)) {
+        fprintf(stderr, "pcm_open(out) failed: %s\n", out ? pcm_get_error(out) : "");
+        if (out)
+            pcm_close(out);
+        return -ENODEV;
+    }
+
+    config.start_threshold = 1;
+    config.stop_threshold = period_size * period_count;
+    in = pcm_open(PCM_CARD, route->device, PCM_IN | PCM_MONOTONIC, &config);
+    if (!in || !pcm_is_ready(in)) {
+        fprintf(stderr, "pcm_open(in) failed: %s\n", in ? pcm_get_error(in) : "");
+        if (in)
+            pcm_close(in);
+        pcm_close(out);
+        return -ENODEV;
+    }
+
+    period_bytes = pcm_frames_to_bytes(out, period_size);
+    play = calloc(1, period_bytes);
+    rec = calloc(1, period_bytes);
+
+    memset(result, 0, sizeof(*result));
+    result->period_size = period_size;
+    result->period_count = period_count;
+
+    /* prime the playback buffer with silence */
+    for (i = 0; i < period_count; i++) {
+        if (pcm_write(out, play, period_bytes) != 0)
+            result->glitches++;
+        written += period_size;
+    }
+
+    while (captured < total) {
+        int ret;
+
+        /* generate the next period, with an impulse when one is due */
+        memset(play, 0, period_bytes);
+        if (sent < NUM_IMPULSES && next_impulse < written + period_size) {
+            unsigned int offset = next_impulse - written;
+            unsigned int n;
+
+            for (n = 0; n < IMPULSE_LEN && offset + n < period_size; n++) {
+                unsigned int c;
+                int16_t v = (n & 1) ? -IMPULSE_AMPLITUDE : IMPULSE_AMPLITUDE;
+
+                for (c = 0; c < route->channels; c++)
+                    play[(offset + n) * route->channels + c] = v;
+            }
+            impulse_pos[sent++] = next_impulse;
+            next_impulse += interval;
+        }
+
+        ret = pcm_write(out, play, period_bytes);
+        if (ret == -EPIPE) {
+            result->glitches++;
+            pcm_prepare(out);
+        } else if (ret != 0) {
+            result->glitches++;
+        }
+        written += period_size;
+
+        if (pcm_read(in, rec, period_bytes) != 0) {
+            result->glitches++;
+            memset(rec, 0, period_bytes);
+        }
+
+        /* the first interval is pure silence: use it as the noise floor */
+        if (captured < interval) {
+            int level = noise_level(rec, period_size, route->channels);
+            if (level > noise)
+                noise = level;
+        } else if (found < sent) {
+            int threshold = noise * DETECT_NOISE_RATIO;
+            int onset;
+
+            if (threshold < DETECT_MIN_LEVEL)
+                threshold = DETECT_MIN_LEVEL;
+            onset = find_onset(rec, period_size, route->channels, threshold);
+            if (onset >= 0 && captured + onset > impulse_pos[found]) {
+                latencies[found] = (int)(captured + onset - impulse_pos[found]);
+                found++;
+            }
+        }
+        captured += period_size;
+    }
+
+    result->detected = found;
+    result->seconds = (float)captured / route->rate;
+    if (found > 0) {
+        qsort(latencies, found, sizeof(latencies[0]), compare_int);
+        result->latency_frames = latencies[found / 2];
+    } else {
+        result->latency_frames = -1;
+    }
+
+    free(play);
+    free(rec);
+    pcm_close(in);
+    pcm_close(out);
+    return 0;
+}
+
+/* line written by a previous run for this route, to be replaced */
+static bool is_route_line(const char *line, const char *route_name)
+{
+    size_t len = strlen(route_name);
+
+    if (line[0] == '#')
+        return strncmp(line + 2, route_name, len) == 0 && line[2 + len] == ':';
+
+    return strncmp(line, route_name, len) == 0 && line[len] == '.' &&
+            (strstr(line, "_period=") || strstr(line, "_count="));
+}
+
+/*
+ * Rewrite the profile file, replacing the block of this route. The file is
+ * written to a temporary and renamed, and nothing is written at all when the
+ * existing file does not fit, so other routes' keys are never dropped.
+ */
+static int write_profile(const char *path, const struct route *route,
+                         const struct result *best)
+{
+    char lines[PROFILE_MAX_LINES][PROFILE_LINE_LEN];
+    char tmp[PATH_MAX];
+    unsigned int num_lines = 0, i;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f != NULL) {
+        char line[PROFILE_LINE_LEN];
+
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (strchr(line, '\n') == NULL && !feof(f)) {
+                fprintf(stderr, "%s: line longer than %d characters, not updating\n",
+                        path, PROFILE_LINE_LEN - 1);
+                fclose(f);
+                return -EFBIG;
+            }
+            if (is_route_line(line, route->name))
+                continue;
+            if (num_lines == PROFILE_MAX_LINES) {
+                fprintf(stderr, "%s: more than %d lines, not updating\n",
+                        path, PROFILE_MAX_LINES);
+                fclose(f);
+                return -EFBIG;
+            }
+            strcpy(lines[num_lines++], line);
+        }
+        fclose(f);
+    } else if (errno != ENOENT) {
+        fprintf(stderr, "cannot read %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        fprintf(stderr, "cannot write %s: %s\n", tmp, strerror(errno));
+        return -errno;
+    }
+
+    for (i = 0; i < num_lines; i++) {
+        fputs(lines[i], f);
+        /* a last line without newline must not run into the route block */
+        if (lines[i][strlen(lines[i]) - 1] != '\n')
+            fputc('\n', f);
+    }
+    fprintf(f, "# %s: %d frames round trip, %u glitches in %.1f s\n", route->name,
+            best->latency_frames, best->glitches, best->seconds);
+    fprintf(f, "%s.out_period=%u\n", route->name, best->period_size);
+    fprintf(f, "%s.out_count=%u\n", route->name, best->period_count);
+    fprintf(f, "%s.in_period=%u\n", route->name, best->period_size);
+    fprintf(f, "%s.in_count=%u\n", route->name, best->period_count);
+
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -EIO;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-r spk|hs|bt] [-o profile_file] [-n]\n"
+            "  -r  route to calibrate (default spk)\n"
+            "  -o  profile file to update (default " PROFILE_FILE ")\n"
+            "  -n  measure only, do not write the profile\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const struct route *route = &routes[0];
+    const char *path = PROFILE_FILE;
+    struct result best = { 0 };
+    bool have_best = false;
+    bool dry_run = false;
+    unsigned int p, c;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:o:nh")) != -1) {
+        switch (opt) {
+        case 'r':
+            route = NULL;
+            for (p = 0; p < sizeof(routes) / sizeof(routes[0]); p++) {
+                if (strcmp(routes[p].name, optarg) == 0)
+                    route = &routes[p];
+            }
+            if (route == NULL) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'o':
+            path = optarg;
+            break;
+        case 'n':
+            dry_run = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    set_route(route);
+
+    printf("calibrating route %s at %u Hz\n", route->name, route->rate);
+    printf("period  count  latency(ms)  detected  glitches/s\n");
+
+    for (p = 0; p < sizeof(candidate_periods) / sizeof(candidate_periods[0]); p++) {
+        for (c = 0; c < sizeof(candidate_counts) / sizeof(candidate_counts[0]); c++) {
+            struct result r;
+            unsigned int period = candidate_periods[p];
+
+            /* keep periods comparable in time on the 8 kHz voice PCM */
+            if (route->rate != 44100)
+                period = ((period * route->rate / 44100) + 15) & ~15;
+
+            if (measure(route, period, candidate_counts[c], &r) != 0)
+                continue;
+
+            printf("%6u  %5u  %11.1f  %5u/%u  %10.2f\n", r.period_size, r.period_count,
+                   r.latency_frames < 0 ? -1.0f :
+                           r.latency_frames * 1000.0f / route->rate,
+                   r.detected, NUM_IMPULSES, r.glitches / r.seconds);
+            ALOGD("route %s period %u x %u: latency %d frames, %u glitches",
+                  route->name, r.period_size, r.period_count, r.latency_frames, r.glitches);
+
+            if (r.detected < NUM_IMPULSES)
+                continue;
+            if (!have_best || r.glitches < best.glitches ||
+                    (r.glitches == best.glitches && r.latency_frames < best.latency_frames)) {
+                best = r;
+                have_best = true;
+            }
+        }
+    }
+
+    if (!have_best) {
+        fprintf(stderr, "no candidate passed; check the loopback\n");
+        return 1;
+    }
+
+    printf("best: %u x %u, %.1f ms round trip\n", best.period_size, best.period_count,
+           best.latency_frames * 1000.0f / route->rate);
+
+    if (dry_run)
+        return 0;
+
+    if (write_profile(path, route, &best) != 0)
+        return 1;
+
+    printf("updated %s\n", path);
+    return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "audio_dsp.h"
+
+bool dsp_is_silent(const void *buffer, size_t bytes)
+{
+    const uint8_t *p = (const uint8_t *)buffer;
+    const uint32_t *w;
+    uint32_t acc = 0;
+
+    /* leading bytes up to a word boundary */
+    while (bytes > 0 && ((uintptr_t)p & 3) != 0) {
+        acc |= *p++;
+        bytes--;
+    }
+
+    /*
+     * OR four words per iteration and only test the accumulator once per
+     * 64 bytes: the loop is load bound and exits early on the first audible
+     * block, which is the common case when the stream is not silent.
+     */
+    w = (const uint32_t *)p;
+    while (bytes >= 64) {
+        acc |= w[0] | w[1] | w[2] | w[3];
+        acc |= w[4] | w[5] | w[6] | w[7];
+        acc |= w[8] | w[9] | w[10] | w[11];
+        acc |= w[12] | w[13] | w[14] | w[15];
+        if (acc != 0)
+            return false;
+        w += 16;
+        bytes -= 64;
+    }
+    while (bytes >= 4) {
+        acc |= *w++;
+        bytes -= 4;
+    }
+
+    p = (const uint8_t *)w;
+    while (bytes > 0) {
+        acc |= *p++;
+        bytes--;
+    }
+
+    return acc == 0;
+}
+
+void dsp_apply_gain(int16_t *buffer, size_t frames, unsigned int channels,
+                    int32_t *gain, int32_t target, size_t ramp_frames)
+{
+    size_t samples;
+    size_t i;
+
+    if (*gain != target) {
+        /* Q15 gain with 16 more fractional bits for the per frame step */
+        int64_t g = (int64_t)*gain << 16;
+        int64_t step;
+        size_t n;
+
+        if (ramp_frames == 0)
+            ramp_frames = 1;
+        step = (((int64_t)target << 16) - g) / (int64_t)ramp_frames;
+        if (step == 0)
+            step = target > *gain ? 1 : -1;
+
+        for (n = 0; n < frames; n++) {
+            int32_t q15;
+            unsigned int c;
+
+            g += step;
+            if ((step > 0 && g >= ((int64_t)target << 16)) ||
+                    (step < 0 && g <= ((int64_t)target << 16))) {
+                *gain = target;
+                break;
+            }
+            q15 = (int32_t)(g >> 16);
+            for (c = 0; c < channels; c++, buffer++)
+                *buffer = (int16_t)((*buffer * q15) >> 15);
+        }
+
+        if (*gain != target) {
+            *gain = (int32_t)(g >> 16);
+            return;
+        }
+        frames -= n;
+    }
+
+    if (target == DSP_GAIN_UNITY)
+        return;
+
+    samples = frames * channels;
+    if (target == 0) {
+        memset(buffer, 0, samples * sizeof(int16_t));
+        return;
+    }
+
+    /* gain <= unity, so the products cannot overflow and need no saturation */
+    for (i = 0; i + 4 <= samples; i += 4) {
+        buffer[i] = (int16_t)((buffer[i] * target) >> 15);
+        buffer[i + 1] = (int16_t)((buffer[i + 1] * target) >> 15);
+        buffer[i + 2] = (int16_t)((buffer[i + 2] * target) >> 15);
+        buffer[i + 3] = (int16_t)((buffer[i + 3] * target) >> 15);
+    }
+    for (; i < samples; i++)
+        buffer[i] = (int16_t)((buffer[i] * target) >> 15);
+}
+
+/* biquad design from the RBJ audio EQ cookbook */
+static void dsp_biquad_design(struct dsp_biquad *bq, const struct dsp_eq_band *band,
+                              unsigned int rate)
+{
+    float w0 = 2.0f * (float)M_PI * band->freq / rate;
+    float cw = cosf(w0);
+    float alpha = sinf(w0) / (2.0f * band->q);
+    float a = powf(10.0f, band->gain_db / 40.0f);
+    float sa = 2.0f * sqrtf(a) * alpha;
+    float b0, b1, b2, a0, a1, a2;
+
+    switch (band->type) {
+    case DSP_EQ_HIGHPASS:
+        b0 = (1.0f + cw) / 2.0f;
+        b1 = -(1.0f + cw);
+        b2 = (1.0f + cw) / 2.0f;
+        a0 = 1.0f + alpha;
+        a1 = -2.0f * cw;
+        a2 = 1.0f - alpha;
+        break;
+    case DSP_EQ_LOWSHELF:
+        b0 = a * ((a + 1.0f) - (a - 1.0f) * cw + sa);
+        b1 = 2.0f * a * ((a - 1.0f) - (a + 1.0f) * cw);
+        b2 = a * ((a + 1.0f) - (a - 1.0f) * cw - sa);
+        a0 = (a + 1.0f) + (a - 1.0f) * cw + sa;
+        a1 = -2.0f * ((a - 1.0f) + (a + 1.0f) * cw);
+        a2 = (a + 1.0f) + (a - 1.0f) * cw - sa;
+        break;
+    case DSP_EQ_HIGHSHELF:
+        b0 = a * ((a + 1.0f) + (a - 1.0f) * cw + sa);
+        b1 = -2.0f * a * ((a - 1.0f) + (a + 1.0f) * cw);
+        b2 = a * ((a + 1.0f) + (a - 1.0f) * cw - sa);
+        a0 = (a + 1.0f) - (a - 1.0f) * cw + sa;
+        a1 = 2.0f * ((a - 1.0f) - (a + 1.0f) * cw);
+        a2 = (a + 1.0f) - (a - 1.0f) * cw - sa;
+        break;
+    case DSP_EQ_PEAK:
+    default:
+        b0 = 1.0f + alpha * a;
+        b1 = -2.0f * cw;
+        b2 = 1.0f - alpha * a;
+        a0 = 1.0f + alpha / a;
+        a1 = -2.0f * cw;
+        a2 = 1.0f - alpha / a;
+        break;
+    }
+
+    bq->b0 = b0 / a0;
+    bq->b1 = b1 / a0;
+    bq->b2 = b2 / a0;
+    bq->a1 = a1 / a0;
+    bq->a2 = a2 / a0;
+}
+
+void dsp_eq_init(struct dsp_eq *eq, const struct dsp_eq_band *bands, unsigned int num_bands,
+                 float limit_db, float release_ms, unsigned int rate)
+{
+    unsigned int i;
+
+    memset(eq, 0, sizeof(*eq));
+
+    if (num_bands > DSP_EQ_MAX_BANDS)
+        num_bands = DSP_EQ_MAX_BANDS;
+    for (i = 0; i < num_bands; i++)
+        dsp_biquad_design(&eq->biquad[i], &bands[i], rate);
+    eq->num_biquads = num_bands;
+
+    eq->limit = 32768.0f * powf(10.0f, limit_db / 20.0f);
+    eq->release = 1.0f - expf(-1000.0f / (release_ms * rate));
+    eq->gain = 1.0f;
+}
+
+void dsp_eq_reset(struct dsp_eq *eq)
+{
+    memset(eq->z, 0, sizeof(eq->z));
+    eq->gain = 1.0f;
+}
+
+void dsp_eq_process(struct dsp_eq *eq, int16_t *buffer, size_t frames, unsigned int channels)
+{
+    float x[DSP_EQ_MAX_CHANNELS];
+    size_t n;
+    unsigned int i, c;
+
+    if (channels > DSP_EQ_MAX_CHANNELS)
+        return;
+
+    for (n = 0; n < frames; n++, buffer += channels) {
+        float peak = 0.0f;
+        float target;
+
+        for (c = 0; c < channels; c++) {
+            float v = buffer[c];
+
+            for (i = 0; i < eq->num_biquads; i++) {
+                const struct dsp_biquad *bq = &eq->biquad[i];
+                float *z = eq->z[i][c];
+                float y = bq->b0 * v + z[0];
+
+                z[0] = bq->b1 * v - bq->a1 * y + z[1];
+                z[1] = bq->b2 * v - bq->a2 * y;
+                v = y;
+            }
+            x[c] = v;
+            if (fabsf(v) > peak)
+                peak = fabsf(v);
+        }
+
+        /* instant attack so the output never exceeds the limit, smooth release */
+        target = peak > eq->limit ? eq->limit / peak : 1.0f;
+        if (target < eq->gain)
+            eq->gain = target;
+        else
+            eq->gain += (target - eq->gain) * eq->release;
+
+        for (c = 0; c < channels; c++) {
+            float v = x[c] * eq->gain;
+
+            if (v > 32767.0f)
+                v = 32767.0f;
+            else if (v < -32768.0f)
+                v = -32768.0f;
+            buffer[c] = (int16_t)v;
+        }
+    }
+
+    /* keep denormals out of the recursive state during silence */
+    for (i = 0; i < eq->num_biquads; i++) {
+        for (c = 0; c < channels; c++) {
+            if (fabsf(eq->z[i][c][0]) < 1e-15f)
+                eq->z[i][c][0] = 0.0f;
+            if (fabsf(eq->z[i][c][1]) < 1e-15f)
+                eq->z[i][c][1] = 0.0f;
+        }
+    }
+}
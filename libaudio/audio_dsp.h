@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_DSP_H
+#define AUDIO_DSP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sample processing helpers for the primary output.
+ *
+ * Tegra 2 has no NEON unit, so these are plain C: the integer helpers work
+ * on full 32 bit words and the equaliser uses VFP single precision floats.
+ */
+
+/* true if every byte of the buffer is zero */
+bool dsp_is_silent(const void *buffer, size_t bytes);
+
+#define DSP_GAIN_UNITY 0x8000 /* Q15 */
+
+/*
+ * Scale interleaved 16 bit samples in place by a Q15 gain between 0 and
+ * DSP_GAIN_UNITY. The gain moves linearly from *gain to target over
+ * ramp_frames frames, so volume steps and mute do not click; *gain holds the
+ * gain reached at the end of the buffer.
+ */
+void dsp_apply_gain(int16_t *buffer, size_t frames, unsigned int channels,
+                    int32_t *gain, int32_t target, size_t ramp_frames);
+
+/*
+ * Speaker equaliser: a cascade of float biquads (transposed direct form II)
+ * followed by a peak limiter, on interleaved 16 bit mono or stereo frames.
+ */
+#define DSP_EQ_MAX_BANDS 6
+#define DSP_EQ_MAX_CHANNELS 2
+
+enum dsp_eq_type {
+    DSP_EQ_HIGHPASS,
+    DSP_EQ_LOWSHELF,
+    DSP_EQ_PEAK,
+    DSP_EQ_HIGHSHELF,
+};
+
+struct dsp_eq_band {
+    enum dsp_eq_type type;
+    float freq;                             /* Hz */
+    float q;
+    float gain_db;                          /* ignored for DSP_EQ_HIGHPASS */
+};
+
+struct dsp_biquad {
+    float b0, b1, b2, a1, a2;
+};
+
+struct dsp_eq {
+    unsigned int num_biquads;
+    struct dsp_biquad biquad[DSP_EQ_MAX_BANDS];
+    float z[DSP_EQ_MAX_BANDS][DSP_EQ_MAX_CHANNELS][2];
+
+    float limit;                            /* limiter threshold, full scale = 32768 */
+    float release;                          /* per frame release coefficient */
+    float gain;                             /* current limiter gain */
+};
+
+/* design the biquads for the given rate and clear the filter state */
+void dsp_eq_init(struct dsp_eq *eq, const struct dsp_eq_band *bands, unsigned int num_bands,
+                 float limit_db, float release_ms, unsigned int rate);
+
+/* clear the filter and limiter state, e.g. after a gap of silence */
+void dsp_eq_reset(struct dsp_eq *eq);
+
+void dsp_eq_process(struct dsp_eq *eq, int16_t *buffer, size_t frames, unsigned int channels);
+
+#endif /* AUDIO_DSP_H */
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark of the master volume path of audio.primary.tegra.
+ *
+ * Runs dsp_apply_gain() on one mixer period of stereo 16 bit audio for each
+ * of its cases (unity, mute, fixed gain, gain ramp) next to a plain per
+ * sample reference loop, and checks that the fixed gain output matches the
+ * reference. Builds for the host and the device:
+ *
+ *   audio_dsp_bench [-f frames] [-n iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audio_dsp.h"
+
+#define DEFAULT_FRAMES 1024     /* one mixer period of the primary output */
+#define DEFAULT_ITERATIONS 20000
+#define CHANNELS 2
+#define HALF_GAIN (DSP_GAIN_UNITY / 2)
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* keep the compiler from dropping or merging the work done on buffer */
+static inline void clobber(void *buffer)
+{
+    __asm__ volatile("" : : "r" (buffer) : "memory");
+}
+
+static void fill(int16_t *buffer, size_t samples)
+{
+    size_t i;
+    uint32_t seed = 1;
+
+    for (i = 0; i < samples; i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = (int16_t)(seed >> 16);
+    }
+}
+
+/* what the HAL did before dsp_apply_gain(): one multiply per sample */
+static void reference_gain(int16_t *buffer, size_t samples, int32_t gain)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+        buffer[i] = (int16_t)((buffer[i] * gain) >> 15);
+}
+
+static void report(const char *name, int64_t ns, unsigned int iterations, size_t frames)
+{
+    double per_buffer = (double)ns / iterations;
+
+    printf("  %-18s %9.2f us/period %7.2f ns/frame %8.1f MB/s\n", name,
+           per_buffer / 1000.0, per_buffer / frames,
+           frames * CHANNELS * sizeof(int16_t) * 1000.0 / per_buffer);
+}
+
+int main(int argc, char **argv)
+{
+    size_t frames = DEFAULT_FRAMES;
+    unsigned int iterations = DEFAULT_ITERATIONS, i;
+    int16_t *src, *buf, *ref;
+    int32_t gain;
+    int64_t t;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:n:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f frames] [-n iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (frames == 0 || iterations == 0)
+        return 1;
+
+    src = malloc(frames * CHANNELS * sizeof(int16_t));
+    buf = malloc(frames * CHANNELS * sizeof(int16_t));
+    ref = malloc(frames * CHANNELS * sizeof(int16_t));
+    if (src == NULL || buf == NULL || ref == NULL)
+        return 1;
+    fill(src, frames * CHANNELS);
+
+    /* the fixed gain path must produce exactly what the reference does */
+    memcpy(buf, src, frames * CHANNELS * sizeof(int16_t));
+    memcpy(ref, src, frames * CHANNELS * sizeof(int16_t));
+    gain = HALF_GAIN;
+    dsp_apply_gain(buf, frames, CHANNELS, &gain, HALF_GAIN, 0);
+    reference_gain(ref, frames * CHANNELS, HALF_GAIN);
+    if (memcmp(buf, ref, frames * CHANNELS * sizeof(int16_t)) != 0) {
+        fprintf(stderr, "dsp_apply_gain() differs from the reference\n");
+        return 1;
+    }
+
+    printf("%zu stereo frames, %u iterations\n", frames, iterations);
+
+    /* the copy is part of every measurement, time it on its own too */
+    t = now_ns();
+    for (i = 0; i < iterations; i++) {
+        memcpy(buf, src, frames * CHANNELS * sizeof(int16_t));
+        clobber(buf);
+    }
+    report("copy only", now_ns() - t, iterations, frames);
+
+    t = now_ns();
+    for (i = 0; i < iterations; i++) {
+        memcpy(buf, src, frames * CHANNELS * sizeof(int16_t));
+        reference_gain(buf, frames * CHANNELS, HALF_GAIN);
+        clobber(buf);
+    }
+    report("reference", now_ns() - t, iterations, frames);
+
+    t = now_ns();
+    for (i = 0; i < iterations; i++) {
+        memcpy(buf, src, frames * CHANNELS * sizeof(int16_t));
+        gain = DSP_GAIN_UNITY;
+        dsp_apply_gain(buf, frames, CHANNELS, &gain, DSP_GAIN_UNITY, 0);
+        clobber(buf);
+    }
+    report("unity", now_ns() - t, iterations, frames);
+
+    t = now_ns();
+    for (i = 0; i < iterations; i++) {
+        memcpy(buf, src, frames * CHANNELS * sizeof(int16_t));
+        gain = 0;
+        dsp_apply_gain(buf, frames, CHANNELS, &gain, 0, 0);
+        clobber(buf);
+    }
+    report("mute", now_ns() - t, iterations, frames);
+
+    t = now_ns();
+    for (i = 0; i < iterations; i++) {
+        memcpy(buf, src, frames * CHANNELS * sizeof(int16_t));
+        gain = HALF_GAIN;
+        dsp_apply_gain(buf, frames, CHANNELS, &gain, HALF_GAIN, 0);
+        clobber(buf);
+    }
+    report("fixed gain", now_ns() - t, iterations, frames);
+
+    t = now_ns();
+    for (i = 0; i < iterations; i++) {
+        memcpy(buf, src, frames * CHANNELS * sizeof(int16_t));
+        gain = DSP_GAIN_UNITY;
+        dsp_apply_gain(buf, frames, CHANNELS, &gain, 0, frames);
+        clobber(buf);
+    }
+    report("ramp", now_ns() - t, iterations, frames);
+
+    free(src);
+    free(buf);
+    free(ref);
+    return 0;
+}
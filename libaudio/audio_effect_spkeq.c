@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "speaker_eq"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+#include <hardware/audio_effect.h>
+
+#include "audio_effect_spkeq.h"
+
+/*
+ * Speaker EQ effect library. The EQ runs in the primary output of
+ * audio.primary.tegra (see out_apply_eq()), this only advertises it to the
+ * framework and holds its state: enable and preset.
+ */
+
+struct spkeq_context {
+    const struct effect_interface_s *itfe;  /* must be first */
+    effect_config_t config;
+    int32_t enabled;
+    int32_t preset;
+};
+
+static const effect_descriptor_t spkeq_descriptor = {
+    .type = SPKEQ_TYPE_UUID_,
+    .uuid = SPKEQ_IMPL_UUID_,
+    .apiVersion = EFFECT_CONTROL_API_VERSION,
+    .flags = EFFECT_FLAG_TYPE_POST_PROC | EFFECT_FLAG_INSERT_LAST | EFFECT_FLAG_HW_ACC_TUNNEL,
+    .cpuLoad = 0,                           /* the HAL accounts for the processing */
+    .memoryUsage = 0,
+    .name = "P4 speaker EQ",
+    .implementor = "The Android Open Source Project",
+};
+
+static int spkeq_process(effect_handle_t self, audio_buffer_t *in, audio_buffer_t *out)
+{
+    struct spkeq_context *ctx = (struct spkeq_context *)self;
+    size_t samples;
+
+    if (ctx == NULL || in == NULL || out == NULL || in->raw == NULL || out->raw == NULL)
+        return -EINVAL;
+
+    if (!ctx->enabled)
+        return -ENODATA;
+
+    /* the audio is processed in the HAL: pass it through */
+    if (in->raw == out->raw)
+        return 0;
+
+    samples = in->frameCount *
+            audio_channel_count_from_out_mask(ctx->config.inputCfg.channels);
+    if (ctx->config.outputCfg.accessMode == EFFECT_BUFFER_ACCESS_ACCUMULATE) {
+        size_t i;
+
+        for (i = 0; i < samples; i++) {
+            int32_t s = out->s16[i] + in->s16[i];
+
+            out->s16[i] = s > INT16_MAX ? INT16_MAX : s < INT16_MIN ? INT16_MIN : s;
+        }
+    } else {
+        memcpy(out->raw, in->raw, samples * sizeof(int16_t));
+    }
+    return 0;
+}
+
+static int spkeq_get_param(struct spkeq_context *ctx, effect_param_t *p, uint32_t *reply_size)
+{
+    int32_t *key = (int32_t *)p->data;
+
+    if (p->psize != sizeof(int32_t))
+        return -EINVAL;
+
+    p->vsize = sizeof(int32_t);
+    *reply_size = sizeof(effect_param_t) + 2 * sizeof(int32_t);
+
+    switch (*key) {
+    case SPKEQ_PARAM_PRESET:
+        *(key + 1) = ctx->preset;
+        p->status = 0;
+        break;
+    case SPKEQ_PARAM_ENABLED:
+        *(key + 1) = ctx->enabled;
+        p->status = 0;
+        break;
+    default:
+        p->status = -EINVAL;
+        break;
+    }
+    return 0;
+}
+
+static int spkeq_set_param(struct spkeq_context *ctx, const effect_param_t *p)
+{
+    const int32_t *key = (const int32_t *)p->data;
+
+    if (p->psize != sizeof(int32_t) || p->vsize != sizeof(int32_t))
+        return -EINVAL;
+
+    switch (*key) {
+    case SPKEQ_PARAM_PRESET:
+        if (*(key + 1) < SPKEQ_PRESET_ROUTE)
+            return -EINVAL;
+        /* indexes past the HAL's table fall back to the route preset there */
+        ctx->preset = *(key + 1);
+        ALOGV("spkeq_set_param() preset %d", ctx->preset);
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+static int spkeq_command(effect_handle_t self, uint32_t cmd, uint32_t cmd_size, void *cmd_data,
+                         uint32_t *reply_size, void *reply_data)
+{
+    struct spkeq_context *ctx = (struct spkeq_context *)self;
+
+    if (ctx == NULL)
+        return -EINVAL;
+
+    switch (cmd) {
+    case EFFECT_CMD_INIT:
+    case EFFECT_CMD_RESET:
+        if (cmd == EFFECT_CMD_INIT)
+            ctx->preset = SPKEQ_PRESET_ROUTE;
+        if (reply_data != NULL && reply_size != NULL && *reply_size >= sizeof(int)) {
+            *(int *)reply_data = 0;
+            *reply_size = sizeof(int);
+        }
+        break;
+    case EFFECT_CMD_ENABLE:
+    case EFFECT_CMD_DISABLE:
+        if (reply_data == NULL || reply_size == NULL || *reply_size < sizeof(int))
+            return -EINVAL;
+        ctx->enabled = cmd == EFFECT_CMD_ENABLE;
+        ALOGV("spkeq_command() %s", ctx->enabled ? "enable" : "disable");
+        *(int *)reply_data = 0;
+        *reply_size = sizeof(int);
+        break;
+    case EFFECT_CMD_SET_CONFIG:
+        if (cmd_data == NULL || cmd_size != sizeof(effect_config_t) ||
+                reply_data == NULL || reply_size == NULL || *reply_size < sizeof(int))
+            return -EINVAL;
+        ctx->config = *(effect_config_t *)cmd_data;
+        *(int *)reply_data = 0;
+        *reply_size = sizeof(int);
+        break;
+    case EFFECT_CMD_GET_CONFIG:
+        if (reply_data == NULL || reply_size == NULL ||
+                *reply_size < sizeof(effect_config_t))
+            return -EINVAL;
+        *(effect_config_t *)reply_data = ctx->config;
+        *reply_size = sizeof(effect_config_t);
+        break;
+    case EFFECT_CMD_GET_PARAM:
+        if (cmd_data == NULL || cmd_size < sizeof(effect_param_t) + sizeof(int32_t) ||
+                reply_data == NULL || reply_size == NULL ||
+                *reply_size < sizeof(effect_param_t) + 2 * sizeof(int32_t))
+            return -EINVAL;
+        memcpy(reply_data, cmd_data, sizeof(effect_param_t) + sizeof(int32_t));
+        return spkeq_get_param(ctx, (effect_param_t *)reply_data, reply_size);
+    case EFFECT_CMD_SET_PARAM:
+        if (cmd_data == NULL || cmd_size < sizeof(effect_param_t) + 2 * sizeof(int32_t) ||
+                reply_data == NULL || reply_size == NULL || *reply_size < sizeof(int32_t))
+            return -EINVAL;
+        *(int32_t *)reply_data = spkeq_set_param(ctx, (effect_param_t *)cmd_data);
+        *reply_size = sizeof(int32_t);
+        break;
+    case EFFECT_CMD_SET_DEVICE:
+    case EFFECT_CMD_SET_VOLUME:
+    case EFFECT_CMD_SET_AUDIO_MODE:
+        /* the HAL picks the speaker route itself */
+        break;
+    default:
+        ALOGW("spkeq_command() unsupported command %u", cmd);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int spkeq_get_descriptor(effect_handle_t self, effect_descriptor_t *desc)
+{
+    if (self == NULL || desc == NULL)
+        return -EINVAL;
+
+    *desc = spkeq_descriptor;
+    return 0;
+}
+
+static const struct effect_interface_s spkeq_interface = {
+    .process = spkeq_process,
+    .command = spkeq_command,
+    .get_descriptor = spkeq_get_descriptor,
+    .process_reverse = NULL,
+};
+
+static int32_t spkeq_create(const effect_uuid_t *uuid, int32_t session_id, int32_t io_id,
+                            effect_handle_t *handle)
+{
+    struct spkeq_context *ctx;
+
+    if (uuid == NULL || handle == NULL ||
+            memcmp(uuid, SPKEQ_IMPL_UUID, sizeof(effect_uuid_t)) != 0)
+        return -EINVAL;
+
+    ctx = calloc(1, sizeof(struct spkeq_context));
+    if (ctx == NULL)
+        return -ENOMEM;
+
+    ctx->itfe = &spkeq_interface;
+    ctx->preset = SPKEQ_PRESET_ROUTE;
+    *handle = (effect_handle_t)ctx;
+
+    ALOGV("spkeq_create() session %d io %d: %p", session_id, io_id, ctx);
+    return 0;
+}
+
+static int32_t spkeq_release(effect_handle_t handle)
+{
+    if (handle == NULL)
+        return -EINVAL;
+
+    ALOGV("spkeq_release() %p", handle);
+    free(handle);
+    return 0;
+}
+
+static int32_t spkeq_lib_get_descriptor(const effect_uuid_t *uuid, effect_descriptor_t *desc)
+{
+    if (uuid == NULL || desc == NULL ||
+            memcmp(uuid, SPKEQ_IMPL_UUID, sizeof(effect_uuid_t)) != 0)
+        return -EINVAL;
+
+    *desc = spkeq_descriptor;
+    return 0;
+}
+
+__attribute__ ((visibility ("default")))
+audio_effect_library_t AUDIO_EFFECT_LIBRARY_INFO_SYM = {
+    .tag = AUDIO_EFFECT_LIBRARY_TAG,
+    .version = EFFECT_LIBRARY_API_VERSION,
+    .name = "P4 Speaker EQ Library",
+    .implementor = "The Android Open Source Project",
+    .create_effect = spkeq_create,
+    .release_effect = spkeq_release,
+    .get_descriptor = spkeq_lib_get_descriptor,
+};
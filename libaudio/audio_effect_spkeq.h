@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_EFFECT_SPKEQ_H
+#define AUDIO_EFFECT_SPKEQ_H
+
+#include <stdint.h>
+
+#include <hardware/audio_effect.h>
+
+/*
+ * Speaker EQ, shared by libspeakereq (audio_effect_spkeq.c) and
+ * audio.primary.tegra.
+ *
+ * The effect is a tunnelled post processing effect: its process() does not
+ * touch the audio. AudioFlinger hands the effect to the primary output
+ * through add_audio_effect() when it is enabled. The handle it passes is the
+ * effects factory wrapper, not the library context, so the HAL reads the
+ * enable state and preset back with EFFECT_CMD_GET_PARAM and runs the EQ on
+ * speaker playback.
+ */
+
+/* 44ad6439-385d-439d-9f3b-68b892c9bb40 */
+static const effect_uuid_t SPKEQ_TYPE_UUID_ = {
+    0x44ad6439, 0x385d, 0x439d, 0x9f3b, { 0x68, 0xb8, 0x92, 0xc9, 0xbb, 0x40 }
+};
+static const effect_uuid_t * const SPKEQ_TYPE_UUID = &SPKEQ_TYPE_UUID_;
+
+/* b90b1cff-c4c3-4cb1-9551-310185ffa29a */
+static const effect_uuid_t SPKEQ_IMPL_UUID_ = {
+    0xb90b1cff, 0xc4c3, 0x4cb1, 0x9551, { 0x31, 0x01, 0x85, 0xff, 0xa2, 0x9a }
+};
+static const effect_uuid_t * const SPKEQ_IMPL_UUID = &SPKEQ_IMPL_UUID_;
+
+/* parameters, int32_t key and value */
+enum spkeq_params {
+    SPKEQ_PARAM_PRESET,     /* index in the HAL's preset table */
+    SPKEQ_PARAM_ENABLED,    /* read only, 1 while enabled */
+};
+
+/* use the preset of the speaker route profile (speaker_eq parameter) */
+#define SPKEQ_PRESET_ROUTE (-1)
+
+#endif /* AUDIO_EFFECT_SPKEQ_H */
@@ -21,10 +21,12 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/utsname.h>
+#include <time.h>
 
 #include <cutils/log.h>
 #include <cutils/properties.h>
@@ -45,6 +47,8 @@
 
 #include <dlfcn.h>
 
+#include "audio_dsp.h"
+#include "audio_effect_spkeq.h"
 #include "secril-client.h"
 #include "tegra_audio.h"
 
@@ -59,6 +63,8 @@ enum {
 
 #define PCM_CARD 0
 #define PCM_DEVICE 0
+#define PCM_DEVICE_AUX 1 /* pcm.aux in asound.conf: hw:0,1 */
+#define PCM_DEVICE_VOICE 2 /* pcm.voice in asound.conf: hw:0,2 */
 
 #define MIXER_CARD 0
 
@@ -67,23 +73,74 @@ enum {
 #define OUT_LONG_PERIOD_COUNT 4
 #define OUT_SAMPLING_RATE 44100
 
+/* AUDIO_OUTPUT_FLAG_FAST streams (touch sounds, games) on the aux PCM */
+#define OUT_FAST_PERIOD_SIZE 256
+#define OUT_FAST_PERIOD_COUNT 2
+
 #define IN_PERIOD_SIZE 1024
 #define IN_PERIOD_SIZE_LOW_LATENCY 512
 #define IN_PERIOD_COUNT 4
 #define IN_SAMPLING_RATE 44100
 
-/* minimum sleep time in out_write() when write threshold is not reached */
+/* Bluetooth SCO runs on the voice PCM at its native rate */
+#define VOICE_PERIOD_SIZE 160 /* 20 ms */
+#define VOICE_PERIOD_COUNT 4
+#define VOICE_SAMPLING_RATE 8000
+
+/*
+ * minimum sleep time in out_write() when write threshold is not reached.
+ * The maximum defaults to the duration of OUT_SHORT_PERIOD_COUNT periods.
+ */
 #define MIN_WRITE_SLEEP_US 2000
-#define MAX_WRITE_SLEEP_US ((OUT_PERIOD_SIZE * OUT_SHORT_PERIOD_COUNT * 1000000) \
-                                / OUT_SAMPLING_RATE)
+
+/*
+ * After this much digital silence the primary output stops the PCM and paces
+ * further silent writes from a timer until audible data comes back.
+ */
+#define IDLE_STANDBY_MS 2000
+
+/* master volume and mute changes are ramped over this time */
+#define MASTER_GAIN_RAMP_MS 10
+
+/* limiter release time of the speaker equaliser */
+#define EQ_LIMITER_RELEASE_MS 50
+
+/*
+ * Voice recognition pre-roll: while a voice recognition input is open but in
+ * standby, keep capturing the last persist.audio.vr_preroll_ms milliseconds
+ * (0, the default, disables it) and hand them over on the next read.
+ */
+#define VR_PREROLL_PROPERTY "persist.audio.vr_preroll_ms"
+#define VR_PREROLL_MAX_MS 5000
+
+/*
+ * Per route PCM profiles. The defaults above can be overridden at adev_open()
+ * by "<route>.<key>=<value>" lines in the profile file (written by
+ * audio_calibrate) and then by persist.audio.<route>.<key> properties.
+ */
+#define ROUTE_PROFILE_FILE "/data/misc/audio/audio_hw_tegra.conf"
+#define ROUTE_PROFILE_SYSTEM_FILE "/system/etc/audio_hw_tegra.conf"
+#define ROUTE_PROFILE_PROPERTY_PREFIX "persist.audio."
+
+#define ROUTE_PROFILE_MAX_PERIOD_SIZE 8192
+#define ROUTE_PROFILE_MIN_PERIOD_COUNT 2
+#define ROUTE_PROFILE_MAX_PERIOD_COUNT 16
 
 /* from Tuna */
 #define MAX_PREPROCESSORS 3 /* maximum one AGC + one NS + one AEC per input stream */
+#define MAX_SPEAKER_EQ 4    /* speaker EQ effects attached to an output, one per session */
 
 
 #define SPDIF_FD "/dev/spdif_out"
 #define SPDIFCTL_FD "/dev/spdif_out_ctl"
 
+/* speaker EQ effect attached to an output, state read through its command() */
+struct spkeq_effect {
+    effect_handle_t handle;
+    bool enabled;
+    int32_t preset;                         /* SPKEQ_PRESET_ROUTE or index in eq_presets[] */
+};
+
 struct effect_info_s {
     effect_handle_t effect_itfe;
     size_t num_channel_configs;
@@ -96,6 +153,19 @@ enum {
     OUT_BUFFER_TYPE_LONG,
 };
 
+enum {
+    ROUTE_PROFILE_SPEAKER,
+    ROUTE_PROFILE_HEADSET,
+    ROUTE_PROFILE_BT,
+    ROUTE_PROFILE_CNT,
+};
+
+static const char * const route_profile_names[ROUTE_PROFILE_CNT] = {
+    [ROUTE_PROFILE_SPEAKER] = "spk",
+    [ROUTE_PROFILE_HEADSET] = "hs",
+    [ROUTE_PROFILE_BT] = "bt",
+};
+
 typedef enum {
     TTY_MODE_OFF,
     TTY_MODE_VCO,
@@ -116,6 +186,15 @@ struct pcm_config pcm_config_out = {
     // .avail_min = 0,
 };
 
+struct pcm_config pcm_config_out_fast = {
+    .channels = 2,
+    .rate = OUT_SAMPLING_RATE,
+    .period_size = OUT_FAST_PERIOD_SIZE,
+    .period_count = OUT_FAST_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = OUT_FAST_PERIOD_SIZE,
+};
+
 struct pcm_config pcm_config_in = {
     .channels = 2,
     .rate = IN_SAMPLING_RATE,
@@ -140,6 +219,99 @@ struct pcm_config pcm_config_in_low_latency = {
     .stop_threshold = (IN_PERIOD_SIZE_LOW_LATENCY * IN_PERIOD_COUNT),
 };
 
+struct pcm_config pcm_config_voice_out = {
+    .channels = 1,
+    .rate = VOICE_SAMPLING_RATE,
+    .period_size = VOICE_PERIOD_SIZE,
+    .period_count = VOICE_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = VOICE_PERIOD_SIZE * OUT_SHORT_PERIOD_COUNT,
+};
+
+struct pcm_config pcm_config_voice_in = {
+    .channels = 1,
+    .rate = VOICE_SAMPLING_RATE,
+    .period_size = VOICE_PERIOD_SIZE,
+    .period_count = VOICE_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+    .start_threshold = 1,
+    .stop_threshold = (VOICE_PERIOD_SIZE * VOICE_PERIOD_COUNT),
+};
+
+struct route_profile {
+    unsigned int pcm_device;
+    struct pcm_config out;
+    struct pcm_config in;
+    struct pcm_config in_low_latency;
+    unsigned int min_write_sleep_us;
+    unsigned int max_write_sleep_us;
+    unsigned int idle_standby_ms;           /* 0 disables the silence detector */
+    unsigned int eq_preset;                 /* index in eq_presets[], speaker only */
+};
+
+/*
+ * Speaker equaliser presets. The P4 speakers are small and sit in a sealed
+ * enclosure: cut what they cannot reproduce, take out the boxy low mids and
+ * lift the presence region a little. The limiter keeps the boosts from
+ * clipping.
+ */
+static const struct dsp_eq_band eq_bands_p4_speaker[] = {
+    { DSP_EQ_HIGHPASS,    200.0f, 0.707f,  0.0f },
+    { DSP_EQ_PEAK,        500.0f, 1.0f,   -3.0f },
+    { DSP_EQ_PEAK,       3000.0f, 1.4f,    2.5f },
+    { DSP_EQ_HIGHSHELF, 10000.0f, 0.707f, -2.0f },
+};
+
+struct eq_preset {
+    const char *name;
+    const struct dsp_eq_band *bands;
+    unsigned int num_bands;
+    float limit_db;
+};
+
+static const struct eq_preset eq_presets[] = {
+    { "off", NULL, 0, 0.0f },
+    { "p4_speaker", eq_bands_p4_speaker,
+      sizeof(eq_bands_p4_speaker) / sizeof(eq_bands_p4_speaker[0]), -1.0f },
+};
+
+#define EQ_PRESET_OFF 0
+#define EQ_PRESET_SPEAKER_DEFAULT 1
+#define EQ_PRESET_CNT (sizeof(eq_presets) / sizeof(eq_presets[0]))
+
+/*
+ * Output timestamp model.
+ *
+ * Every successful write samples the kernel queue with pcm_get_htimestamp()
+ * and adds a (time, presented frames) point to a small least squares fit.
+ * The fitted line is published through a sequence counter, so the timestamp
+ * getters can extrapolate the position to any CLOCK_MONOTONIC time without
+ * taking the stream lock. All positions are in stream frames.
+ */
+#define TS_MODEL_POINTS 8
+#define TS_MODEL_MIN_POINTS 3
+#define TS_MODEL_MAX_DRIFT 0.02 /* fitted rate is kept within 2% of nominal */
+
+struct ts_model_state {
+    bool valid;
+    bool running;               /* false in standby: the position is frozen */
+    int64_t anchor_ns;          /* CLOCK_MONOTONIC time of anchor_frames */
+    uint64_t anchor_frames;     /* frames presented at anchor_ns */
+    uint64_t written;           /* frames written when the state was published */
+    double rate;                /* frames per second */
+};
+
+struct ts_model {
+    uint32_t seq;               /* odd while the writer is publishing */
+    struct ts_model_state state;
+
+    /* writer side, protected by the stream lock */
+    int64_t point_ns[TS_MODEL_POINTS];
+    uint64_t point_frames[TS_MODEL_POINTS];
+    unsigned int num_points;
+    unsigned int next_point;
+};
+
 struct audio_device {
     struct audio_hw_device hw_device;
 
@@ -150,6 +322,9 @@ struct audio_device {
     int in_source;
     bool standby;
     bool mic_mute;
+    bool capture_blocked;       /* mic_mute or in call, read by the pre-roll thread */
+    float master_volume;
+    bool master_mute;
     // struct audio_route *ar;
     // struct mixer* mixer;
     bool screen_off;
@@ -165,6 +340,8 @@ struct audio_device {
 
     struct stream_out *active_out;
     struct stream_in *active_in;
+
+    struct route_profile profiles[ROUTE_PROFILE_CNT];
 };
 
 struct stream_out {
@@ -172,14 +349,30 @@ struct stream_out {
 
     pthread_mutex_t lock; /* see note below on mutex acquisition order */
     struct pcm *pcm;
-    struct pcm_config *pcm_config;
+    struct pcm_config *pcm_config;          /* current configuration */
+    struct pcm_config *main_config;         /* configuration reported to AudioFlinger */
+    struct route_profile *profile;          /* profile of the current route */
+    bool fast;                              /* low latency stream on the aux PCM */
 
     // SPDIF
     int spdif_fd;
     int spdif_ctl_fd;
 
     bool standby;
-    uint64_t written; /* total frames written, not cleared when entering standby */
+    uint64_t written; /* total stream frames written, not cleared when entering standby */
+    struct ts_model ts;
+
+    /* warm standby while AudioFlinger writes digital silence */
+    int32_t master_gain;                    /* Q15 master gain reached, -1 before the first write */
+    unsigned int eq_preset;                 /* preset loaded in eq */
+    struct dsp_eq eq;
+    struct spkeq_effect spkeq[MAX_SPEAKER_EQ]; /* speaker EQ effects attached by AudioFlinger */
+    unsigned int num_spkeq;
+
+    uint64_t silent_frames;                 /* length of the current silent run */
+    bool idle;                              /* PCM stopped, writes paced by idle_deadline */
+    uint64_t idle_queued;                   /* frames queued when the PCM was stopped */
+    struct timespec idle_deadline;
 
     struct resampler_itfe *resampler;
     int16_t *buffer;
@@ -203,6 +396,7 @@ struct stream_in {
     pthread_mutex_t lock; /* see note below on mutex acquisition order */
     struct pcm *pcm;
     struct pcm_config *pcm_config;          /* current configuration */
+    bool low_latency;                       /* AUDIO_INPUT_FLAG_FAST at 44.1 kHz */
     bool standby;
 
     unsigned int requested_rate;
@@ -234,6 +428,26 @@ struct stream_in {
     struct audio_device *dev;
 
     int64_t last_read_time_us;
+
+    /*
+     * While the mic is muted outside of a call, in_read() returns silence
+     * paced by a timer and the capture PCM stays closed.
+     */
+    bool muted;
+    struct timespec mute_deadline; /* CLOCK_MONOTONIC end of the last muted read */
+
+    /* voice recognition pre-roll, see in_preroll_start() */
+    audio_source_t source;
+    unsigned int preroll_ms;
+    struct pcm *preroll_pcm;
+    unsigned int preroll_device;
+    struct pcm_config *preroll_config;
+    pthread_t preroll_thread;
+    bool preroll_running;
+    char *preroll_buf;
+    size_t preroll_size;                    /* ring size in bytes */
+    size_t preroll_rd;                      /* oldest byte in the ring */
+    size_t preroll_fill;                    /* bytes held in the ring */
 };
 
 
@@ -248,6 +462,7 @@ static uint32_t out_get_sample_rate(const struct audio_stream *stream);
 static size_t out_get_buffer_size(const struct audio_stream *stream);
 static audio_format_t out_get_format(const struct audio_stream *stream);
 static int out_flush(struct audio_stream_out* stream);
+static void out_update_spkeq(struct stream_out *out);
 static uint32_t in_get_sample_rate(const struct audio_stream *stream);
 static size_t in_get_buffer_size(const struct audio_stream *stream);
 static audio_format_t in_get_format(const struct audio_stream *stream);
@@ -690,6 +905,388 @@ static void select_voice_route(struct audio_device *adev, struct mixer* mixer)
     ALOGD("select_voice_route() out_device %d tty_mode %d", out_device, tty_mode);
 }
 
+static bool out_route_is_sco(struct audio_device *adev)
+{
+    return (adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO) != 0;
+}
+
+static bool in_route_is_sco(struct audio_device *adev)
+{
+    return (adev->in_device & (AUDIO_DEVICE_IN_ALL_SCO & ~AUDIO_DEVICE_BIT_IN)) != 0;
+}
+
+static struct route_profile *get_output_profile(struct audio_device *adev)
+{
+    if (out_route_is_sco(adev))
+        return &adev->profiles[ROUTE_PROFILE_BT];
+    if (adev->out_device &
+            (AUDIO_DEVICE_OUT_WIRED_HEADSET | AUDIO_DEVICE_OUT_WIRED_HEADPHONE))
+        return &adev->profiles[ROUTE_PROFILE_HEADSET];
+    return &adev->profiles[ROUTE_PROFILE_SPEAKER];
+}
+
+static struct route_profile *get_input_profile(struct audio_device *adev)
+{
+    if (in_route_is_sco(adev))
+        return &adev->profiles[ROUTE_PROFILE_BT];
+    if (adev->in_device & (AUDIO_DEVICE_IN_WIRED_HEADSET & ~AUDIO_DEVICE_BIT_IN))
+        return &adev->profiles[ROUTE_PROFILE_HEADSET];
+    return &adev->profiles[ROUTE_PROFILE_SPEAKER];
+}
+
+static struct pcm_config *in_select_config(struct stream_in *in)
+{
+    struct route_profile *profile = get_input_profile(in->dev);
+
+    return in->low_latency ? &profile->in_low_latency : &profile->in;
+}
+
+/* route profile loading */
+
+static void route_profile_set(struct route_profile *profile, const char *name,
+                              const char *key, const char *value)
+{
+    char *end;
+    unsigned long val = strtoul(value, &end, 0);
+
+    if (end == value ||
+            (val == 0 && strcmp(key, "idle_ms") != 0 && strcmp(key, "eq") != 0)) {
+        ALOGW("route profile %s.%s: invalid value '%s'", name, key, value);
+        return;
+    }
+
+    if (strcmp(key, "out_period") == 0 || strcmp(key, "in_period") == 0 ||
+            strcmp(key, "in_ll_period") == 0) {
+        /* audioflinger expects capture buffers to be a multiple of 16 frames */
+        if (val > ROUTE_PROFILE_MAX_PERIOD_SIZE || (val % 16) != 0) {
+            ALOGW("route profile %s.%s: bad period size %lu", name, key, val);
+            return;
+        }
+    } else if (strcmp(key, "eq") == 0) {
+        if (strcmp(name, route_profile_names[ROUTE_PROFILE_SPEAKER]) != 0 && val != EQ_PRESET_OFF) {
+            ALOGW("route profile %s.%s: the equaliser is for the speaker only", name, key);
+            return;
+        }
+        if (val >= EQ_PRESET_CNT) {
+            ALOGW("route profile %s.%s: unknown preset %lu", name, key, val);
+            return;
+        }
+    } else if (strcmp(key, "out_count") == 0 || strcmp(key, "in_count") == 0) {
+        if (val < ROUTE_PROFILE_MIN_PERIOD_COUNT || val > ROUTE_PROFILE_MAX_PERIOD_COUNT) {
+            ALOGW("route profile %s.%s: bad period count %lu", name, key, val);
+            return;
+        }
+    }
+
+    if (strcmp(key, "out_period") == 0)
+        profile->out.period_size = val;
+    else if (strcmp(key, "out_count") == 0)
+        profile->out.period_count = val;
+    else if (strcmp(key, "in_period") == 0)
+        profile->in.period_size = val;
+    else if (strcmp(key, "in_count") == 0)
+        profile->in.period_count = profile->in_low_latency.period_count = val;
+    else if (strcmp(key, "in_ll_period") == 0)
+        profile->in_low_latency.period_size = val;
+    else if (strcmp(key, "min_sleep") == 0)
+        profile->min_write_sleep_us = val;
+    else if (strcmp(key, "max_sleep") == 0)
+        profile->max_write_sleep_us = val;
+    else if (strcmp(key, "idle_ms") == 0)
+        profile->idle_standby_ms = val;
+    else if (strcmp(key, "eq") == 0)
+        profile->eq_preset = val;
+    else {
+        ALOGW("route profile: unknown key %s.%s", name, key);
+        return;
+    }
+
+    ALOGV("route profile %s.%s = %lu", name, key, val);
+}
+
+static struct route_profile *route_profile_by_name(struct audio_device *adev,
+                                                   const char *name)
+{
+    int i;
+
+    for (i = 0; i < ROUTE_PROFILE_CNT; i++) {
+        if (strcmp(route_profile_names[i], name) == 0)
+            return &adev->profiles[i];
+    }
+    return NULL;
+}
+
+static int load_route_profile_file(struct audio_device *adev, const char *path)
+{
+    char line[128];
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -errno;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char name[16], key[32], value[32];
+        struct route_profile *profile;
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, " %15[^.].%31[^= ] = %31s", name, key, value) != 3) {
+            ALOGW("%s: ignoring malformed line '%s'", path, line);
+            continue;
+        }
+
+        profile = route_profile_by_name(adev, name);
+        if (profile == NULL) {
+            ALOGW("%s: unknown route '%s'", path, name);
+            continue;
+        }
+        route_profile_set(profile, name, key, value);
+    }
+
+    fclose(f);
+    ALOGI("loaded route profiles from %s", path);
+    return 0;
+}
+
+static void load_route_profiles(struct audio_device *adev)
+{
+    static const char * const keys[] = {
+        "out_period", "out_count", "in_period", "in_count", "in_ll_period",
+        "min_sleep", "max_sleep", "idle_ms", "eq",
+    };
+    char prop[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    unsigned int i, k;
+
+    for (i = 0; i < ROUTE_PROFILE_CNT; i++) {
+        struct route_profile *profile = &adev->profiles[i];
+
+        /*
+         * SCO goes straight to the 8 kHz mono voice PCM, so the codec does not
+         * have to run the I2S link at 44.1 kHz and convert it back down again.
+         */
+        if (i == ROUTE_PROFILE_BT) {
+            profile->pcm_device = PCM_DEVICE_VOICE;
+            profile->out = pcm_config_voice_out;
+            profile->in = pcm_config_voice_in;
+            profile->in_low_latency = pcm_config_voice_in;
+        } else {
+            profile->pcm_device = PCM_DEVICE;
+            profile->out = pcm_config_out;
+            profile->in = pcm_config_in;
+            profile->in_low_latency = pcm_config_in_low_latency;
+        }
+        profile->min_write_sleep_us = MIN_WRITE_SLEEP_US;
+        profile->max_write_sleep_us = 0;
+        profile->idle_standby_ms = IDLE_STANDBY_MS;
+        profile->eq_preset = i == ROUTE_PROFILE_SPEAKER ?
+                EQ_PRESET_SPEAKER_DEFAULT : EQ_PRESET_OFF;
+    }
+
+    if (load_route_profile_file(adev, ROUTE_PROFILE_FILE) != 0)
+        load_route_profile_file(adev, ROUTE_PROFILE_SYSTEM_FILE);
+
+    for (i = 0; i < ROUTE_PROFILE_CNT; i++) {
+        struct route_profile *profile = &adev->profiles[i];
+
+        for (k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+            snprintf(prop, sizeof(prop), ROUTE_PROFILE_PROPERTY_PREFIX "%s.%s",
+                     route_profile_names[i], keys[k]);
+            if (property_get(prop, value, NULL) > 0)
+                route_profile_set(profile, route_profile_names[i], keys[k], value);
+        }
+
+        /* keep the thresholds consistent with the (possibly) new periods */
+        profile->out.start_threshold = profile->out.period_size * OUT_SHORT_PERIOD_COUNT;
+        if (profile->out.start_threshold > profile->out.period_size * profile->out.period_count)
+            profile->out.start_threshold = profile->out.period_size * profile->out.period_count;
+        profile->in.stop_threshold = profile->in.period_size * profile->in.period_count;
+        profile->in_low_latency.stop_threshold =
+                profile->in_low_latency.period_size * profile->in_low_latency.period_count;
+        if (profile->max_write_sleep_us == 0)
+            profile->max_write_sleep_us = (unsigned int)(((uint64_t)profile->out.period_size *
+                    OUT_SHORT_PERIOD_COUNT * 1000000) / profile->out.rate);
+
+        ALOGI("route profile %s: out %u x %u, in %u x %u (low latency %u), sleep %u..%u us,"
+              " idle %u ms, eq %s",
+              route_profile_names[i],
+              profile->out.period_size, profile->out.period_count,
+              profile->in.period_size, profile->in.period_count,
+              profile->in_low_latency.period_size,
+              profile->min_write_sleep_us, profile->max_write_sleep_us,
+              profile->idle_standby_ms, eq_presets[profile->eq_preset].name);
+    }
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void timespec_add_ns(struct timespec *ts, int64_t ns)
+{
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+}
+
+static void ts_model_publish(struct ts_model *model, const struct ts_model_state *state)
+{
+    uint32_t seq = model->seq;
+
+    __atomic_store_n(&model->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    model->state = *state;
+    __atomic_store_n(&model->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* may be called from any thread, without the stream lock */
+static void ts_model_read(struct ts_model *model, struct ts_model_state *state)
+{
+    uint32_t seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&model->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        *state = model->state;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&model->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+}
+
+/* frames presented at time_ns according to a published state */
+static uint64_t ts_model_position(const struct ts_model_state *state, int64_t time_ns)
+{
+    double frames = (double)state->anchor_frames;
+
+    if (state->running)
+        frames += state->rate * (double)(time_ns - state->anchor_ns) / 1000000000.0;
+    if (frames < 0)
+        return 0;
+    if (frames > (double)state->written)
+        return state->written;
+    return (uint64_t)frames;
+}
+
+/* drop the fit history, e.g. when the PCM restarts or underruns */
+static void ts_model_reset(struct ts_model *model)
+{
+    model->num_points = 0;
+    model->next_point = 0;
+}
+
+/* freeze the position when the PCM is closed, must hold the stream lock */
+static void ts_model_stop(struct ts_model *model)
+{
+    struct ts_model_state state = model->state;
+    int64_t now = now_ns();
+
+    if (state.valid) {
+        state.anchor_frames = ts_model_position(&state, now);
+        state.anchor_ns = now;
+        state.running = false;
+        ts_model_publish(model, &state);
+    }
+    ts_model_reset(model);
+}
+
+/* add a measured point and publish the new fit, must hold the stream lock */
+static void ts_model_update(struct ts_model *model, int64_t time_ns, uint64_t presented,
+                            uint64_t written, uint32_t nominal_rate)
+{
+    const struct ts_model_state *prev = &model->state;
+    struct ts_model_state state;
+    double rate = nominal_rate;
+    double anchor = (double)presented;
+    unsigned int i;
+
+    model->point_ns[model->next_point] = time_ns;
+    model->point_frames[model->next_point] = presented;
+    model->next_point = (model->next_point + 1) % TS_MODEL_POINTS;
+    if (model->num_points < TS_MODEL_POINTS)
+        model->num_points++;
+
+    /*
+     * Fit presented = anchor + rate * (t - time_ns). Coordinates are taken
+     * relative to the newest point to keep the sums small enough for doubles.
+     */
+    if (model->num_points >= TS_MODEL_MIN_POINTS) {
+        double mean_x = 0, mean_y = 0, sxx = 0, sxy = 0;
+        double n = model->num_points;
+
+        for (i = 0; i < model->num_points; i++) {
+            mean_x += (double)(model->point_ns[i] - time_ns) / 1000000000.0;
+            mean_y += (double)((int64_t)(model->point_frames[i] - presented));
+        }
+        mean_x /= n;
+        mean_y /= n;
+
+        for (i = 0; i < model->num_points; i++) {
+            double dx = (double)(model->point_ns[i] - time_ns) / 1000000000.0 - mean_x;
+            double dy = (double)((int64_t)(model->point_frames[i] - presented)) - mean_y;
+            sxx += dx * dx;
+            sxy += dx * dy;
+        }
+
+        if (sxx > 0) {
+            double fitted = sxy / sxx;
+            if (fitted > nominal_rate * (1.0 - TS_MODEL_MAX_DRIFT) &&
+                    fitted < nominal_rate * (1.0 + TS_MODEL_MAX_DRIFT)) {
+                rate = fitted;
+                anchor = (double)presented + mean_y - rate * mean_x;
+            }
+        }
+    }
+
+    if (anchor < 0)
+        anchor = 0;
+    if (anchor > (double)written)
+        anchor = (double)written;
+
+    state.valid = true;
+    state.running = true;
+    state.anchor_ns = time_ns;
+    state.anchor_frames = (uint64_t)anchor;
+    state.written = written;
+    state.rate = rate;
+
+    /* never let readers see the position go backwards */
+    if (prev->valid) {
+        uint64_t floor = ts_model_position(prev, time_ns);
+        if (state.anchor_frames < floor)
+            state.anchor_frames = floor;
+    }
+
+    ts_model_publish(model, &state);
+}
+
+/* must be called with the output stream mutex locked, after a successful write */
+static void out_update_timestamp(struct stream_out *out)
+{
+    uint32_t rate = out_get_sample_rate(&out->stream.common);
+    unsigned int avail;
+    struct timespec ts;
+    uint64_t queued;
+
+    if (pcm_get_htimestamp(out->pcm, &avail, &ts) != 0)
+        return;
+
+    queued = pcm_get_buffer_size(out->pcm) - avail;
+    if (out->pcm_config->rate != rate)
+        queued = queued * rate / out->pcm_config->rate;
+    if (queued > out->written)
+        queued = out->written;
+
+    ts_model_update(&out->ts, ts.tv_sec * 1000000000LL + ts.tv_nsec,
+                    out->written - queued, out->written, rate);
+}
+
 /* must be called with hw device and output stream mutexes locked */
 static void do_out_standby(struct stream_out *out)
 {
@@ -698,7 +1295,11 @@ static void do_out_standby(struct stream_out *out)
     if (!out->standby) {
         pcm_close(out->pcm);
         out->pcm = NULL;
-        adev->active_out = NULL;
+        ts_model_stop(&out->ts);
+        out->idle = false;
+        out->silent_frames = 0;
+        if (adev->active_out == out)
+            adev->active_out = NULL;
         if (out->resampler) {
             release_resampler(out->resampler);
             out->resampler = NULL;
@@ -762,9 +1363,17 @@ static int start_output_stream(struct stream_out *out)
 
     ALOGD("start_output_stream()");
 
-    device = PCM_DEVICE;
-    out->pcm_config = &pcm_config_out;
+    out->profile = get_output_profile(adev);
+    out_update_spkeq(out);
+    if (out->fast) {
+        device = PCM_DEVICE_AUX;
+        out->pcm_config = out->main_config;
+    } else {
+        device = out->profile->pcm_device;
+        out->pcm_config = &out->profile->out;
+    }
     out->buffer_type = OUT_BUFFER_TYPE_UNKNOWN;
+    ts_model_reset(&out->ts);
 
     out->pcm = pcm_open(PCM_CARD, device, PCM_OUT | PCM_NORESTART | PCM_MONOTONIC, out->pcm_config);
 
@@ -786,7 +1395,7 @@ static int start_output_stream(struct stream_out *out)
                                RESAMPLER_QUALITY_DEFAULT,
                                NULL,
                                &out->resampler);
-        out->buffer_frames = (pcm_config_out.period_size * out->pcm_config->rate) /
+        out->buffer_frames = (out->main_config->period_size * out->pcm_config->rate) /
                 out_get_sample_rate(&out->stream.common) + 1;
 
         out->buffer = malloc(pcm_frames_to_bytes(out->pcm, out->buffer_frames));
@@ -795,22 +1404,229 @@ static int start_output_stream(struct stream_out *out)
             out->pcm_config->rate);
     }
 
-    adev->active_out = out;
+    /* only the primary stream takes part in the input/output restart dance */
+    if (!out->fast)
+        adev->active_out = out;
 
     ALOGD("start_output_stream() done");
 
     return 0;
 }
 
+static bool in_is_voice_recognition(struct stream_in *in)
+{
+    return in->source == AUDIO_SOURCE_VOICE_RECOGNITION ||
+            in->dev->in_source == AUDIO_SOURCE_VOICE_RECOGNITION;
+}
+
+/* append to the pre-roll ring, dropping the oldest bytes when it is full */
+static void in_preroll_write(struct stream_in *in, const char *data, size_t bytes)
+{
+    size_t wr, part;
+
+    if (bytes >= in->preroll_size) {
+        data += bytes - in->preroll_size;
+        bytes = in->preroll_size;
+        in->preroll_rd = 0;
+        in->preroll_fill = 0;
+    }
+
+    wr = (in->preroll_rd + in->preroll_fill) % in->preroll_size;
+    part = in->preroll_size - wr;
+    if (part > bytes)
+        part = bytes;
+    memcpy(in->preroll_buf + wr, data, part);
+    memcpy(in->preroll_buf, data + part, bytes - part);
+
+    in->preroll_fill += bytes;
+    if (in->preroll_fill > in->preroll_size) {
+        in->preroll_rd = (in->preroll_rd + in->preroll_fill - in->preroll_size) %
+                in->preroll_size;
+        in->preroll_fill = in->preroll_size;
+    }
+}
+
+/*
+ * The pre-roll thread cannot take the hw device mutex, in_preroll_stop() joins
+ * it with the mutex held. Must be called with hw device mutex locked whenever
+ * mic_mute or mode change.
+ */
+static void adev_update_capture_blocked(struct audio_device *adev)
+{
+    __atomic_store_n(&adev->capture_blocked,
+                     adev->mic_mute || adev->mode == AUDIO_MODE_IN_CALL, __ATOMIC_RELEASE);
+}
+
+static void *in_preroll_thread(void *context)
+{
+    struct stream_in *in = (struct stream_in *)context;
+    struct audio_device *adev = in->dev;
+    size_t period_bytes = pcm_frames_to_bytes(in->preroll_pcm, in->preroll_config->period_size);
+    char *buf = malloc(period_bytes);
+
+    ALOGD("in_preroll_thread() started");
+
+    while (buf != NULL && __atomic_load_n(&in->preroll_running, __ATOMIC_ACQUIRE)) {
+        /* give the ADC back while muted or in call, in_read() takes it from there */
+        if (__atomic_load_n(&adev->capture_blocked, __ATOMIC_ACQUIRE)) {
+            pcm_stop(in->preroll_pcm);
+            in->preroll_fill = 0;
+            break;
+        }
+        if (pcm_read(in->preroll_pcm, buf, period_bytes) != 0) {
+            ALOGW("in_preroll_thread() pcm_read error: %s", pcm_get_error(in->preroll_pcm));
+            usleep(in->preroll_config->period_size * 1000000LL / in->preroll_config->rate);
+            continue;
+        }
+        in_preroll_write(in, buf, period_bytes);
+    }
+
+    free(buf);
+    ALOGD("in_preroll_thread() exiting");
+    return NULL;
+}
+
+/*
+ * Keep capturing into the pre-roll ring after the stream went to standby.
+ * The stream stays the active input while the pre-roll runs, so out_write()
+ * restarts it like a running capture and start_input_stream() of any other
+ * stream takes the device back (see in_preroll_yield()). Pre-roll state is
+ * protected by the hw device mutex. Must be called with hw device and input
+ * stream mutexes locked.
+ */
+static void in_preroll_start(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+    struct stream_in *active = adev->active_in;
+    struct pcm_config *config;
+
+    if (in->preroll_ms == 0 || in->preroll_running || !in_is_voice_recognition(in) ||
+            !in->standby || adev->mic_mute || adev->mode == AUDIO_MODE_IN_CALL)
+        return;
+
+    /* another input is capturing or holds its own pre-roll */
+    if (active != NULL && active != in && (!active->standby || active->preroll_pcm != NULL))
+        return;
+
+    config = in_select_config(in);
+    if (in->preroll_buf == NULL) {
+        size_t period_bytes = config->period_size * config->channels * sizeof(int16_t);
+        size_t periods = ((size_t)in->preroll_ms * config->rate / 1000 +
+                config->period_size - 1) / config->period_size;
+
+        in->preroll_size = periods * period_bytes;
+        in->preroll_buf = malloc(in->preroll_size);
+        if (in->preroll_buf == NULL)
+            return;
+    }
+    in->preroll_rd = 0;
+    in->preroll_fill = 0;
+
+    in->preroll_device = get_input_profile(adev)->pcm_device;
+    in->preroll_config = config;
+    in->preroll_pcm = pcm_open(PCM_CARD, in->preroll_device, PCM_IN | PCM_MONOTONIC, config);
+    if (in->preroll_pcm && !pcm_is_ready(in->preroll_pcm)) {
+        ALOGE("in_preroll_start() pcm_open failed: %s", pcm_get_error(in->preroll_pcm));
+        pcm_close(in->preroll_pcm);
+        in->preroll_pcm = NULL;
+        return;
+    }
+
+    in->preroll_running = true;
+    if (pthread_create(&in->preroll_thread, NULL, in_preroll_thread, in) != 0) {
+        ALOGE("in_preroll_start() cannot create thread");
+        in->preroll_running = false;
+        pcm_close(in->preroll_pcm);
+        in->preroll_pcm = NULL;
+        return;
+    }
+    adev->active_in = in;
+}
+
+/* stop the capture thread, the PCM and the ring contents are kept */
+static void in_preroll_stop(struct stream_in *in)
+{
+    if (!in->preroll_running)
+        return;
+
+    __atomic_store_n(&in->preroll_running, false, __ATOMIC_RELEASE);
+    pthread_join(in->preroll_thread, NULL);
+}
+
+/* must be called with the hw device mutex locked */
+static void in_preroll_release(struct stream_in *in)
+{
+    in_preroll_stop(in);
+    if (in->preroll_pcm) {
+        pcm_close(in->preroll_pcm);
+        in->preroll_pcm = NULL;
+    }
+    in->preroll_fill = 0;
+}
+
+/*
+ * The pre-roll of another input gives the capture device back before in
+ * opens it. Must be called with the hw device mutex locked.
+ */
+static void in_preroll_yield(struct stream_in *in)
+{
+    struct stream_in *active = in->dev->active_in;
+
+    if (active != NULL && active != in && active->preroll_pcm != NULL) {
+        ALOGD("in_preroll_yield() releasing the pre-roll of %p", active);
+        in_preroll_release(active);
+    }
+}
+
+/* pcm_read() that first hands over what the pre-roll ring captured */
+static int in_pcm_read(struct stream_in *in, void *buffer, size_t bytes)
+{
+    size_t n = 0;
+
+    while (in->preroll_fill > 0 && n < bytes) {
+        size_t part = in->preroll_size - in->preroll_rd;
+
+        if (part > in->preroll_fill)
+            part = in->preroll_fill;
+        if (part > bytes - n)
+            part = bytes - n;
+        memcpy((char *)buffer + n, in->preroll_buf + in->preroll_rd, part);
+        in->preroll_rd = (in->preroll_rd + part) % in->preroll_size;
+        in->preroll_fill -= part;
+        n += part;
+    }
+
+    if (n == bytes)
+        return 0;
+    return pcm_read(in->pcm, (char *)buffer + n, bytes - n);
+}
+
 /* must be called with hw device and input stream mutexes locked */
 static int start_input_stream(struct stream_in *in)
 {
     struct audio_device *adev = in->dev;
+    unsigned int device;
     int ret;
 
     ALOGD("start_input_stream()");
 
-    in->pcm = pcm_open(PCM_CARD, PCM_DEVICE, PCM_IN | PCM_MONOTONIC, in->pcm_config);
+    in->pcm_config = in_select_config(in);
+    device = get_input_profile(adev)->pcm_device;
+
+    in_preroll_yield(in);
+
+    /* take over the pre-roll capture if it still matches the route */
+    in_preroll_stop(in);
+    if (in->preroll_pcm && in->preroll_device == device &&
+            in->preroll_config == in->pcm_config) {
+        ALOGD("start_input_stream() using pre-roll, %u bytes buffered",
+              (unsigned int)in->preroll_fill);
+        in->pcm = in->preroll_pcm;
+        in->preroll_pcm = NULL;
+    } else {
+        in_preroll_release(in);
+        in->pcm = pcm_open(PCM_CARD, device, PCM_IN | PCM_MONOTONIC, in->pcm_config);
+    }
 
     if (in->pcm && !pcm_is_ready(in->pcm)) {
         ALOGE("pcm_open(in) failed: %s", pcm_get_error(in->pcm));
@@ -866,9 +1682,9 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
     }
 
     if (in->read_buf_frames == 0) {
-        in->read_status = pcm_read(in->pcm,
-                                   (void*)in->read_buf,
-                                   in->read_buf_size);
+        in->read_status = in_pcm_read(in,
+                                      (void*)in->read_buf,
+                                      in->read_buf_size);
         if (in->read_status != 0) {
             ALOGE("get_next_buffer() pcm_read error %d", in->read_status);
             buffer->raw = NULL;
@@ -981,7 +1797,6 @@ static void adev_unlock(struct audio_device *adev) {
     pthread_mutex_unlock(&adev->lock);
 }
 
-
 /* API functions */
 
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
@@ -996,7 +1811,9 @@ static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
 
 static size_t out_get_buffer_size(const struct audio_stream *stream)
 {
-    return pcm_config_out.period_size *
+    struct stream_out *out = (struct stream_out *)stream;
+
+    return out->main_config->period_size *
                audio_stream_out_frame_size((const struct audio_stream_out *)stream);
 }
 
@@ -1095,11 +1912,10 @@ static char * out_get_parameters(const struct audio_stream *stream, const char *
 
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
-    size_t period_count;
-
-    period_count = OUT_LONG_PERIOD_COUNT;
+    struct stream_out *out = (struct stream_out *)stream;
+    struct pcm_config *config = out->main_config;
 
-    return (pcm_config_out.period_size * period_count * 1000) / pcm_config_out.rate;
+    return (config->period_size * config->period_count * 1000) / config->rate;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
@@ -1168,6 +1984,8 @@ static int legacy_out_write(struct audio_stream_out *stream, const void* buffer,
     {
         int total_sleep_time_us = 0;
         size_t period_size = out->pcm_config->period_size;
+        int min_sleep_us = out->profile->min_write_sleep_us;
+        int max_sleep_us = out->profile->max_write_sleep_us;
 
         /* do not allow more than out->cur_write_threshold frames in kernel
          * pcm driver buffer */
@@ -1186,20 +2004,20 @@ static int legacy_out_write(struct audio_stream_out *stream, const void* buffer,
                 int sleep_time_us =
                     (int)(((int64_t)(kernel_frames - out->cur_write_threshold)
                                     * 1000000) / out->pcm_config->rate);
-                if (sleep_time_us < MIN_WRITE_SLEEP_US)
+                if (sleep_time_us < min_sleep_us)
                     break;
                 total_sleep_time_us += sleep_time_us;
-                if (total_sleep_time_us > MAX_WRITE_SLEEP_US) {
+                if (total_sleep_time_us > max_sleep_us) {
                     ALOGW("out_write() limiting sleep time %d to %d",
-                          total_sleep_time_us, MAX_WRITE_SLEEP_US);
-                    sleep_time_us = MAX_WRITE_SLEEP_US -
+                          total_sleep_time_us, max_sleep_us);
+                    sleep_time_us = max_sleep_us -
                                         (total_sleep_time_us - sleep_time_us);
                 }
                 usleep(sleep_time_us);
             }
 
         } while ((kernel_frames > out->cur_write_threshold) &&
-                (total_sleep_time_us <= MAX_WRITE_SLEEP_US));
+                (total_sleep_time_us <= max_sleep_us));
 
         /* do not allow abrupt changes on buffer size. Increasing/decreasing
          * the threshold by steps of 1/4th of the buffer size keeps the write
@@ -1226,21 +2044,157 @@ static int legacy_out_write(struct audio_stream_out *stream, const void* buffer,
         }
     }
 
-    ret = pcm_write(out->pcm, in_buffer, out_frames * frame_size);
-    if (ret == -EPIPE) {
-        /* In case of underrun, don't sleep since we want to catch up asap */
-        // adev_unlock(adev);
-        out_unlock(out);
+    ret = pcm_write(out->pcm, in_buffer, out_frames * frame_size);
+    if (ret == -EPIPE) {
+        /* In case of underrun, don't sleep since we want to catch up asap */
+        ALOGV("-----out_write(%p, %d) END WITH ERROR -EPIPE", buffer, (int)bytes);
+    }
+
+    return ret;
+}
+
+/* must be called with the output stream mutex locked */
+static void out_apply_eq(struct stream_out *out, void *buffer, size_t bytes)
+{
+    uint32_t rate = out_get_sample_rate(&out->stream.common);
+    unsigned int preset = EQ_PRESET_OFF;
+
+    /*
+     * The speaker profile also covers the earpiece and HDMI. Once the
+     * framework attaches the speaker EQ effect, its enable and preset win
+     * over the profile.
+     */
+    if (out->dev->out_device & AUDIO_DEVICE_OUT_SPEAKER) {
+        unsigned int i;
+
+        preset = out->num_spkeq > 0 ? EQ_PRESET_OFF : out->profile->eq_preset;
+        for (i = 0; i < out->num_spkeq; i++) {
+            int32_t fx_preset = out->spkeq[i].preset;
+
+            if (!out->spkeq[i].enabled)
+                continue;
+            if (fx_preset >= 0 && (size_t)fx_preset < EQ_PRESET_CNT)
+                preset = fx_preset;
+            else
+                preset = out->profile->eq_preset;
+            break;
+        }
+    }
+
+    if (preset != out->eq_preset) {
+        ALOGD("out_apply_eq() preset %s", eq_presets[preset].name);
+        dsp_eq_init(&out->eq, eq_presets[preset].bands, eq_presets[preset].num_bands,
+                    eq_presets[preset].limit_db, EQ_LIMITER_RELEASE_MS, rate);
+        out->eq_preset = preset;
+    }
+    if (preset == EQ_PRESET_OFF)
+        return;
+
+    dsp_eq_process(&out->eq, (int16_t *)buffer, bytes / audio_stream_out_frame_size(&out->stream),
+                   audio_channel_count_from_out_mask(out_get_channels(&out->stream.common)));
+}
+
+static int32_t out_master_gain_target(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+
+    return adev->master_mute ? 0 : (int32_t)(adev->master_volume * DSP_GAIN_UNITY + 0.5f);
+}
+
+/* must be called with the output stream mutex locked */
+static void out_apply_master_gain(struct stream_out *out, void *buffer, size_t bytes)
+{
+    uint32_t rate = out_get_sample_rate(&out->stream.common);
+    unsigned int channels = audio_channel_count_from_out_mask(
+            out_get_channels(&out->stream.common));
+    int32_t target = out_master_gain_target(out);
+
+    if (out->master_gain < 0)
+        out->master_gain = target;
+    if (out->master_gain == DSP_GAIN_UNITY && target == DSP_GAIN_UNITY)
+        return;
+
+    dsp_apply_gain((int16_t *)buffer, bytes / audio_stream_out_frame_size(&out->stream),
+                   channels, &out->master_gain, target, rate * MASTER_GAIN_RAMP_MS / 1000);
+}
+
+/*
+ * Digital silence leaves the EQ and the gain with nothing to do: settle the
+ * gain ramp and drop the filter state instead. Must be called with the
+ * output stream mutex locked.
+ */
+static void out_settle_dsp(struct stream_out *out)
+{
+    out->master_gain = out_master_gain_target(out);
+    if (out->eq_preset != EQ_PRESET_OFF)
+        dsp_eq_reset(&out->eq);
+}
+
+/*
+ * Idle standby on the primary output, must be called with the output
+ * stream mutex locked. Returns true if the buffer was consumed in idle
+ * standby and must not be written to the PCM.
+ */
+static bool out_write_idle(struct stream_out *out, bool silent, size_t bytes)
+{
+    size_t frames = bytes / audio_stream_out_frame_size(&out->stream);
+    uint32_t rate = out_get_sample_rate(&out->stream.common);
+    int64_t duration_ns = (int64_t)frames * 1000000000LL / rate;
+    struct timespec now;
+
+    if (!silent) {
+        out->silent_frames = 0;
+        if (out->idle) {
+            ALOGD("out_write() leaving idle standby");
+            /* pcm_write() prepares and restarts the stopped PCM */
+            out->idle = false;
+            out->buffer_type = OUT_BUFFER_TYPE_UNKNOWN;
+            ts_model_reset(&out->ts);
+        }
+        return false;
+    }
+
+    out->silent_frames += frames;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-        ALOGV("-----out_write(%p, %d) END WITH ERROR -EPIPE", buffer, (int)bytes);
+    if (!out->idle) {
+        unsigned int avail;
+        struct timespec ts;
 
-        return ret;
-    }
-    if (ret == 0) {
-        out->written += out_frames;
+        if (out->silent_frames < (uint64_t)out->profile->idle_standby_ms * rate / 1000)
+            return false;
+
+        /* the frames still queued are never presented: keep them out of the position */
+        out->idle_queued = 0;
+        if (pcm_get_htimestamp(out->pcm, &avail, &ts) == 0) {
+            out->idle_queued = pcm_get_buffer_size(out->pcm) - avail;
+            if (out->pcm_config->rate != rate)
+                out->idle_queued = out->idle_queued * rate / out->pcm_config->rate;
+        }
+        if (out->idle_queued > out->written)
+            out->idle_queued = out->written;
+
+        ALOGD("out_write() %u ms of silence, entering idle standby",
+              out->profile->idle_standby_ms);
+        pcm_stop(out->pcm);
+        out->idle = true;
+        out->idle_deadline = now;
+        ts_model_reset(&out->ts);
+    } else if ((now.tv_sec - out->idle_deadline.tv_sec) * 1000000000LL +
+            (now.tv_nsec - out->idle_deadline.tv_nsec) > duration_ns) {
+        /* the writer stalled, do not burst to catch up */
+        out->idle_deadline = now;
     }
 
-    return ret;
+    timespec_add_ns(&out->idle_deadline, duration_ns);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &out->idle_deadline, NULL) == EINTR)
+        ;
+
+    out->written += frames;
+    ts_model_update(&out->ts,
+                    out->idle_deadline.tv_sec * 1000000000LL + out->idle_deadline.tv_nsec,
+                    out->written - out->idle_queued, out->written, rate);
+    return true;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -1252,6 +2206,8 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
 
     bool in_locked = false;
     bool restart_input = false;
+    bool restart_preroll = false;
+    bool silent;
 
      ALOGV("-----out_write(%p, %d) START", buffer, (int)bytes);
 
@@ -1281,8 +2237,9 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         ALOGD("out_write(): pcm playback is exiting standby %x.", (unsigned int)out);
         adev_lock(adev);
 
+        /* a running pre-roll is restarted like a running input */
         struct stream_in* in = adev->active_in;
-        while (in != NULL && !in->standby) {
+        while (in != NULL && (!in->standby || in->preroll_pcm != NULL)) {
             ALOGD("out_write(): Warning: active_in is present.");
 
             // undo locks so that input can be locked in proper order
@@ -1302,6 +2259,10 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                     restart_input = true;
                     ALOGD("out_write(): forcing input standby");
                     do_in_standby(in);
+                } else if (in->preroll_pcm != NULL) {
+                    ALOGD("out_write(): stopping input pre-roll");
+                    restart_preroll = true;
+                    in_preroll_release(in);
                 }
 
                 ALOGD("out_write(): input wait done.");
@@ -1335,6 +2296,8 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                     // do_in_standby(in);
                 }
             }
+            if (restart_preroll)
+                in_preroll_start(in);
             if (in_locked) {
                 ALOGD("out_write(): release input lock.");
                 in_unlock(in);
@@ -1359,9 +2322,23 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     }
 
 
-    if (adev->out_device &
+    /*
+     * The gain is linear, so applying it at the stream rate ahead of the
+     * resampler gives the same result and also covers the SPDIF path.
+     * Silence is checked first: it needs neither, and idle standby reuses
+     * the result.
+     */
+    silent = dsp_is_silent(buffer, bytes);
+    if (silent) {
+        out_settle_dsp(out);
+    } else {
+        out_apply_eq(out, (void *)buffer, bytes);
+        out_apply_master_gain(out, (void *)buffer, bytes);
+    }
+
+    if (!out->fast && (adev->out_device &
             (AUDIO_DEVICE_OUT_AUX_DIGITAL |
-            AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET)) {
+            AUDIO_DEVICE_OUT_DGTL_DOCK_HEADSET))) {
         size_t spdif_bytes_writn = 0;
         unsigned int spdif_ret;
         spdif_ret = write(out->spdif_fd, buffer, bytes);
@@ -1376,12 +2353,26 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         goto exit;
     }
 
-    if (adev->legacy_kernel) {
+    if (!out->fast && out->profile->idle_standby_ms > 0 &&
+            out_write_idle(out, silent, bytes)) {
+        ret = 0;
+        goto exit;
+    }
+
+    /* the voice PCM needs downmixing and resampling on the way out */
+    if (adev->legacy_kernel || out->resampler != NULL) {
         ret = legacy_out_write(stream, buffer, bytes);
     } else {
         ret = pcm_write(out->pcm, (void *)buffer, bytes);
     }
 
+    if (ret == 0) {
+        out->written += bytes / audio_stream_out_frame_size(stream);
+        out_update_timestamp(out);
+    } else if (ret == -EPIPE) {
+        ts_model_reset(&out->ts);
+    }
+
 exit:
     // adev_unlock(adev);
     out_unlock(out);
@@ -1420,11 +2411,62 @@ exit:
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
-    return -EINVAL;
+    struct stream_out *out = (struct stream_out *)stream;
+    struct ts_model_state state;
+
+    ts_model_read(&out->ts, &state);
+    if (!state.valid)
+        return -EINVAL;
+
+    *dsp_frames = (uint32_t)ts_model_position(&state, now_ns());
+    return 0;
+}
+
+static int spkeq_get_param(effect_handle_t effect, int32_t key, int32_t *value)
+{
+    uint32_t buf[(sizeof(effect_param_t) + 2 * sizeof(int32_t)) / sizeof(uint32_t)];
+    effect_param_t *p = (effect_param_t *)buf;
+    uint32_t reply_size = sizeof(buf);
+    int status;
+
+    p->psize = sizeof(int32_t);
+    p->vsize = sizeof(int32_t);
+    *(int32_t *)p->data = key;
+    status = (*effect)->command(effect, EFFECT_CMD_GET_PARAM,
+                                sizeof(effect_param_t) + sizeof(int32_t), p, &reply_size, p);
+    if (status == 0)
+        status = p->status;
+    if (status == 0)
+        *value = *((int32_t *)p->data + 1);
+    return status;
+}
+
+/*
+ * Refresh the cached speaker EQ state. AudioFlinger attaches the effect when
+ * it is enabled and detaches it when disabled, a preset change is picked up
+ * here on the next attach or standby exit.
+ * must be called with the output stream mutex locked
+ */
+static void out_update_spkeq(struct stream_out *out)
+{
+    unsigned int i;
+
+    for (i = 0; i < out->num_spkeq; i++) {
+        struct spkeq_effect *fx = &out->spkeq[i];
+        int32_t enabled = 0;
+        int32_t preset = SPKEQ_PRESET_ROUTE;
+
+        if (spkeq_get_param(fx->handle, SPKEQ_PARAM_ENABLED, &enabled) != 0 ||
+                spkeq_get_param(fx->handle, SPKEQ_PARAM_PRESET, &preset) != 0)
+            ALOGW("out_update_spkeq() cannot read speaker EQ state");
+        fx->enabled = enabled != 0;
+        fx->preset = preset;
+    }
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
+    struct stream_out *out = (struct stream_out *)stream;
     int status;
     effect_descriptor_t desc;
 
@@ -1434,19 +2476,63 @@ static int out_add_audio_effect(const struct audio_stream *stream, effect_handle
 
     ALOGD("out_add_audio_effect(), effect type: %08x", desc.type.timeLow);
 
+    /* the speaker EQ is tunnelled: its state drives out_apply_eq() */
+    if (memcmp(&desc.uuid, SPKEQ_IMPL_UUID, sizeof(effect_uuid_t)) == 0) {
+        out->sleep_req = true;
+        out_lock(out);
+        out->sleep_req = false;
+        if (out->num_spkeq < MAX_SPEAKER_EQ) {
+            out->spkeq[out->num_spkeq++].handle = effect;
+            out_update_spkeq(out);
+        } else {
+            status = -ENOSYS;
+        }
+        out_unlock(out);
+    }
+
 exit:
-    return 0;
+    ALOGW_IF(status != 0, "out_add_audio_effect() error %d", status);
+    return status;
 }
 
 static int out_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
+    struct stream_out *out = (struct stream_out *)stream;
+    unsigned int i;
+
+    out->sleep_req = true;
+    out_lock(out);
+    out->sleep_req = false;
+    for (i = 0; i < out->num_spkeq; i++) {
+        if (out->spkeq[i].handle == effect) {
+            ALOGD("out_remove_audio_effect() speaker EQ");
+            out->spkeq[i] = out->spkeq[--out->num_spkeq];
+            break;
+        }
+    }
+    out_unlock(out);
     return 0;
 }
 
 static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
                                         int64_t *timestamp)
 {
-    return -EINVAL;
+    struct stream_out *out = (struct stream_out *)stream;
+    struct ts_model_state state;
+    int64_t time_ns;
+
+    ts_model_read(&out->ts, &state);
+    if (!state.valid || !state.running || state.rate <= 0)
+        return -EINVAL;
+
+    /* the next frame written is presented once everything queued has played */
+    time_ns = state.anchor_ns +
+            (int64_t)((double)(state.written - state.anchor_frames) * 1000000000.0 / state.rate);
+    if (time_ns < now_ns())
+        return -EINVAL;
+
+    *timestamp = time_ns / 1000;
+    return 0;
 }
 
 static int out_flush(struct audio_stream_out* stream)
@@ -1475,33 +2561,20 @@ static int out_get_presentation_position(const struct audio_stream_out *stream,
                                    uint64_t *frames, struct timespec *timestamp)
 {
     struct stream_out *out = (struct stream_out *)stream;
-    int ret = -1;
-
-    out->sleep_req = true;
-    out_lock(out);
-    out->sleep_req = false;
-
-    if (out->pcm == NULL) {
-        ALOGV("out_get_presentation_position() out->pcm is NULL");
-        out_unlock(out);
-        return ret;
-    }
+    struct ts_model_state state;
+    int64_t now = now_ns();
 
-    size_t avail;
-    if (pcm_get_htimestamp(out->pcm, &avail, timestamp) == 0) {
-        size_t kernel_buffer_size = out->pcm_config->period_size * out->pcm_config->period_count;
-        // FIXME This calculation is incorrect if there is buffering after app processor
-        int64_t signed_frames = out->written - kernel_buffer_size + avail;
-        // It would be unusual for this value to be negative, but check just in case ...
-        if (signed_frames >= 0) {
-            *frames = signed_frames;
-            ret = 0;
-        }
+    ts_model_read(&out->ts, &state);
+    if (!state.valid) {
+        ALOGV("out_get_presentation_position() no timestamp yet");
+        return -ENODATA;
     }
 
-    out_unlock(out);
+    *frames = ts_model_position(&state, now);
+    timestamp->tv_sec = now / 1000000000LL;
+    timestamp->tv_nsec = now % 1000000000LL;
 
-    return ret;
+    return 0;
 }
 
 /** audio_stream_in implementation **/
@@ -1561,6 +2634,7 @@ static int in_standby(struct audio_stream *stream)
     in->sleep_req = false;
     adev_lock(in->dev);
     do_in_standby(in);
+    in_preroll_start(in);
     adev_unlock(in->dev);
     in_unlock(in);
 
@@ -1617,9 +2691,12 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
             if (adev->mode != AUDIO_MODE_IN_CALL) {
                 if (!in->standby)
                     do_in_standby(in);
+                in_preroll_release(in);
             }
 
             adev->in_device = val;
+            /* the pre-roll follows the new route */
+            in_preroll_start(in);
             // select_devices(adev);
         }
     }
@@ -1643,6 +2720,122 @@ static int in_set_gain(struct audio_stream_in *stream, float gain)
     return 0;
 }
 
+/*
+ * Muted capture outside of a call: fill the buffer with silence and return
+ * once the frames would have been captured. The deadlines follow each other
+ * so the reader sees the same cadence as a running PCM. Must be called with
+ * the input stream mutex locked and the PCM in standby.
+ */
+static void in_read_muted(struct stream_in *in, void *buffer, size_t bytes)
+{
+    size_t frames = bytes / audio_stream_in_frame_size(&in->stream);
+    int64_t duration_ns = (int64_t)frames * 1000000000LL / in_get_sample_rate(&in->stream.common);
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* restart the timeline on the first muted read or after a stalled reader */
+    if (!in->muted ||
+            (now.tv_sec - in->mute_deadline.tv_sec) * 1000000000LL +
+            (now.tv_nsec - in->mute_deadline.tv_nsec) > duration_ns) {
+        ALOGV("in_read_muted() starting silence timeline");
+        in->mute_deadline = now;
+        in->muted = true;
+    }
+
+    timespec_add_ns(&in->mute_deadline, duration_ns);
+    memset(buffer, 0, bytes);
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &in->mute_deadline, NULL) == EINTR)
+        ;
+
+    in->frames_read += frames;
+}
+
+/*
+ * Bring the capture PCM out of standby, restarting a running output first as
+ * the codec needs. Must be called with the input stream mutex locked, which
+ * is dropped and retaken while the output is locked.
+ */
+static int in_exit_standby(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+    bool out_locked = false;
+    int ret = 0;
+
+    ALOGD("in_exit_standby() pcm capture is exiting standby.");
+    adev_lock(adev);
+
+    struct stream_out* out = adev->active_out;
+    while (out && !out->standby) {
+        ALOGD("in_exit_standby() Warning: active_out is present.");
+
+        // undo locks so we can lock the output in proper order
+        adev_unlock(adev);
+        in_unlock(in);
+
+        ALOGD("in_exit_standby(): initial release locks.");
+        // lock output for standby
+        out->sleep_req = true;
+        out_lock(out);
+        // out->sleep_req = false;
+        in_lock(in);
+        adev_lock(adev);
+        ALOGD("in_exit_standby(): locks taken.");
+
+        if (out == adev->active_out) {
+            out_locked = true;
+            break;
+        }
+
+        ALOGD("in_exit_standby(): release out lock again.");
+        out_unlock(out);
+        out = adev->active_out;
+        ALOGD("in_exit_standby(): release out locks again done.");
+    }
+
+    if (out && !out->standby) {
+        ALOGD("in_exit_standby(): output go into standby.");
+        do_out_standby(out);
+
+        ALOGD("in_exit_standby(): output starting stream.");
+        ret = start_output_stream(out);
+        if (ret != 0)
+            ALOGE("in_exit_standby(): Error restarting output stream.");
+        out->standby = false;
+
+        // ALOGD("in_exit_standby(): output go into standby again.");
+        // do_out_standby(out);
+
+        if (out_locked) {
+            out_unlock(out);
+            out->sleep_req = false;
+            ALOGD("in_exit_standby(): release output lock.");
+        }
+        ALOGD("in_exit_standby(): restart output done. standby %d.", out->standby);
+    }
+
+    ALOGD("in_exit_standby(): starting input stream.");
+    ret = start_input_stream(in);
+    if (ret == 0)
+        in->standby = false;
+
+    /*
+     * mixer must be set when coming out of standby
+     */
+    // audio_route_reset(adev->ar);
+    struct mixer* mixer;
+    mixer = open_mixer();
+    select_devices(adev, mixer);
+    select_input_source(adev, mixer);
+    close_mixer(mixer);
+    // audio_route_update_mixer(adev->ar);
+
+    adev_unlock(adev);
+    ALOGD("in_exit_standby() pcm capture is exiting standby. done.");
+    return ret;
+}
+
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
                        size_t bytes)
 {
@@ -1651,8 +2844,6 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     struct audio_device *adev = in->dev;
     size_t frames_rq = bytes / audio_stream_in_frame_size(stream);
 
-    bool out_locked = false;
-
     if (in->sleep_req) {
         // 10ms are always shorter than the time to reconfigure the audio path
         // which is the only condition when sleep_req would be true.
@@ -1673,79 +2864,31 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
      * mutex
      */
     in_lock(in);
-    if (in->standby) {
-        ALOGD("in_read() pcm capture is exiting standby.");
-        adev_lock(adev);
-
-        struct stream_out* out = adev->active_out;
-        while (out && !out->standby) {
-            ALOGD("in_read() Warning: active_out is present.");
-
-            // undo locks so we can lock the output in proper order
-            adev_unlock(adev);
-            in_unlock(in);
-
-            ALOGD("in_read(): initial release locks.");
-            // lock output for standby
-            out->sleep_req = true;
-            out_lock(out);
-            // out->sleep_req = false;
-            in_lock(in);
-            adev_lock(adev);
-            ALOGD("in_read(): locks taken.");
-
-            if (out == adev->active_out) {
-                out_locked = true;
-                break;
-            }
-
-            ALOGD("in_read(): release out lock again.");
-            out_unlock(out);
-            out = adev->active_out;
-            ALOGD("in_read(): release out locks again done.");
-        }
-
-        if (out && !out->standby) {
-            ALOGD("in_read(): output go into standby.");
-            do_out_standby(out);
-
-            ALOGD("in_read(): output starting stream.");
-            ret = start_output_stream(out);
-            if (ret != 0)
-                ALOGE("in_read(): Error restarting output stream.");
-            out->standby = false;
-
-            // ALOGD("in_read(): output go into standby again.");
-            // do_out_standby(out);
-
-            if (out_locked) {
-                out_unlock(out);
-                out->sleep_req = false;
-                ALOGD("in_read(): release output lock.");
-            }
-            ALOGD("in_read(): restart output done. standby %d.", out->standby);
-        }
-
-        ALOGD("in_read(): starting input stream.");
-        ret = start_input_stream(in);
-        if (ret == 0)
-            in->standby = false;
-
-        /*
-         * mixer must be set when coming out of standby
-         */
-        // audio_route_reset(adev->ar);
-        struct mixer* mixer;
-        mixer = open_mixer();
-        select_devices(adev, mixer);
-        select_input_source(adev, mixer);
-        close_mixer(mixer);
-        // audio_route_update_mixer(adev->ar);
 
+    /* in call mute is handled by RIL */
+    if (adev->mic_mute && adev->mode != AUDIO_MODE_IN_CALL) {
+        adev_lock(adev);
+        in_preroll_release(in);
+        if (!in->standby)
+            do_in_standby(in);
+        /* still the active input, for adev_set_mic_mute(false) */
+        adev->active_in = in;
         adev_unlock(adev);
-        ALOGD("in_read() pcm capture is exiting standby. done.");
+        in_read_muted(in, buffer, bytes);
+        in_unlock(in);
+        return bytes;
+    }
+
+    if (in->muted) {
+        /* unmuted: the PCM is running again, the next deadline no longer applies */
+        ALOGD("in_read() leaving muted capture");
+        in->muted = false;
+        in->last_read_time_us = 0;
     }
 
+    if (in->standby)
+        ret = in_exit_standby(in);
+
     if (ret < 0)
         goto exit;
 
@@ -1759,13 +2902,13 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         unsigned int i;
         int16_t *in_buffer = (int16_t *)buffer;
 
-        ret = pcm_read(in->pcm, in->read_buf, bytes * 2);
+        ret = in_pcm_read(in, in->read_buf, bytes * 2);
 
         /* Discard right channel */
         for (i = 0; i < frames_rq; i++)
             in_buffer[i] = in->read_buf[i * 2];
     } else {
-        ret = pcm_read(in->pcm, buffer, bytes);
+        ret = in_pcm_read(in, buffer, bytes);
     }
 
     if (ret > 0)
@@ -1960,6 +3103,7 @@ static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_
         // in->need_echo_reference = true;
         do_in_standby(in);
         in_configure_reverse(in);
+        in_preroll_start(in);
     }
 
 exit:
@@ -1982,7 +3126,21 @@ static int in_get_capture_position(const struct audio_stream_in *stream,
     int ret = -ENOSYS;
 
     in_lock(in);
-    if (in->pcm) {
+    if (in->muted) {
+        /* frames the silence timeline has "captured" since the last read */
+        struct timespec now;
+        int64_t elapsed_ns;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ns = (now.tv_sec - in->mute_deadline.tv_sec) * 1000000000LL +
+                (now.tv_nsec - in->mute_deadline.tv_nsec);
+        if (elapsed_ns < 0)
+            elapsed_ns = 0;
+        *frames = in->frames_read +
+                elapsed_ns * in_get_sample_rate(&stream->common) / 1000000000LL;
+        *time = now.tv_sec * 1000000000LL + now.tv_nsec;
+        ret = 0;
+    } else if (in->pcm) {
         struct timespec timestamp;
         unsigned int avail;
         if (pcm_get_htimestamp(in->pcm, &avail, &timestamp) == 0) {
@@ -2051,6 +3209,7 @@ static int in_remove_audio_effect(const struct audio_stream *stream, effect_hand
     if (memcmp(&desc.type, FX_IID_AEC, sizeof(effect_uuid_t)) == 0) {
         // in->need_echo_reference = false;
         do_in_standby(in);
+        in_preroll_start(in);
     }
 
 exit:
@@ -2109,27 +3268,40 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
     out->dev = adev;
 
+    if (flags & AUDIO_OUTPUT_FLAG_FAST) {
+        ALOGD("adev_open_output_stream(): low latency output on the aux PCM");
+        out->fast = true;
+        out->main_config = &pcm_config_out_fast;
+    } else {
+        out->main_config = &adev->profiles[ROUTE_PROFILE_SPEAKER].out;
+    }
+
     config->format = out_get_format(&out->stream.common);
     config->channel_mask = out_get_channels(&out->stream.common);
     config->sample_rate = out_get_sample_rate(&out->stream.common);
 
     out->standby = true;
     /* out->written = 0; by calloc() */
+    out->master_gain = -1;
+
+    /* SPDIF, fed by the primary stream only */
+    out->spdif_fd = -1;
+    out->spdif_ctl_fd = -1;
+    if (!out->fast) {
+        fd = open(SPDIF_FD, O_RDWR);
+        if (fd < 0) {
+            ALOGE("Error opening %s", SPDIF_FD);
+            fd = -1;
+        }
+        out->spdif_fd = fd;
 
-    /* SPDIF */
-    fd = open(SPDIF_FD, O_RDWR);
-    if (fd < 0) {
-        ALOGE("Error opening %s", SPDIF_FD);
-        fd = -1;
-    }
-    out->spdif_fd = fd;
-
-    fd = open(SPDIFCTL_FD, O_RDWR);
-    if (fd < 0) {
-        ALOGE("Error opening %s", SPDIFCTL_FD);
-        fd = -1;
+        fd = open(SPDIFCTL_FD, O_RDWR);
+        if (fd < 0) {
+            ALOGE("Error opening %s", SPDIFCTL_FD);
+            fd = -1;
+        }
+        out->spdif_ctl_fd = fd;
     }
-    out->spdif_ctl_fd = fd;
 
 
     *stream_out = &out->stream;
@@ -2223,6 +3395,22 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         }
     }
 
+    /* speaker_eq=<preset name>, picked up by the outputs on their next write */
+    ret = str_parms_get_str(parms, "speaker_eq", value, sizeof(value));
+    if (ret >= 0) {
+        unsigned int i;
+
+        for (i = 0; i < EQ_PRESET_CNT; i++) {
+            if (strcmp(value, eq_presets[i].name) == 0) {
+                ALOGD("adev_set_parameters() speaker eq %s", value);
+                adev->profiles[ROUTE_PROFILE_SPEAKER].eq_preset = i;
+                break;
+            }
+        }
+        if (i == EQ_PRESET_CNT)
+            ALOGW("adev_set_parameters() unknown speaker eq preset %s", value);
+    }
+
     str_parms_destroy(parms);
     return ret;
 }
@@ -2243,34 +3431,51 @@ static int adev_set_voice_volume(struct audio_hw_device *dev, float volume)
     return -ENOSYS;
 }
 
+/*
+ * Master volume and mute are applied by the HAL (see out_apply_master_gain()),
+ * which lets AudioFlinger keep its mixer on the unity gain path.
+ */
 static int adev_set_master_volume(struct audio_hw_device *dev, float volume)
 {
-    // return -ENOSYS;
+    struct audio_device *adev = (struct audio_device *)dev;
 
     ALOGV("Set master volume to %f.\n", volume);
-    // We return an error code here to let the audioflinger do in-software
-    // volume on top of the maximum volume that we set through the SND API.
-    // return error - software mixer will handle it
 
-    // This is from Crespo device source which is AOSP 4.3.1 based.
-    // I don't know if it works for AOSP 5.0
+    if (volume < 0.0f)
+        volume = 0.0f;
+    else if (volume > 1.0f)
+        volume = 1.0f;
+    adev->master_volume = volume;
 
-    return -1;
+    return 0;
 }
 
 static int adev_get_master_volume(struct audio_hw_device *dev, float *volume)
 {
-    return -ENOSYS;
+    struct audio_device *adev = (struct audio_device *)dev;
+
+    *volume = adev->master_volume;
+
+    return 0;
 }
 
 static int adev_set_master_mute(struct audio_hw_device *dev, bool muted)
 {
-    return -ENOSYS;
+    struct audio_device *adev = (struct audio_device *)dev;
+
+    ALOGV("Set master mute to %d.\n", muted);
+    adev->master_mute = muted;
+
+    return 0;
 }
 
 static int adev_get_master_mute(struct audio_hw_device *dev, bool *muted)
 {
-    return -ENOSYS;
+    struct audio_device *adev = (struct audio_device *)dev;
+
+    *muted = adev->master_mute;
+
+    return 0;
 }
 
 static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
@@ -2290,7 +3495,7 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
         out->sleep_req = false;
         out_locked = true;
     }
-    if (in != NULL && !in->standby) {
+    if (in != NULL && (!in->standby || in->preroll_ms > 0)) {
         in->sleep_req = true;
         in_lock(in);
         in->sleep_req = false;
@@ -2300,6 +3505,7 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
 
     audio_mode_t prev_mode = adev->mode;
     adev->mode = mode;
+    adev_update_capture_blocked(adev);
     ALOGD("adev_set_mode() : new %d, old %d", mode, prev_mode);
 
 
@@ -2315,6 +3521,8 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
     }
 
     if (mode == AUDIO_MODE_IN_CALL && !adev->incall_mode) {
+        if (in && in_locked)
+            in_preroll_release(in);
         if (out && !out->standby) {
             ALOGV("adev_set_mode() in call force output standby");
             out_standby(&out->stream.common);
@@ -2378,6 +3586,9 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
         }
 
         adev->incall_mode = false;
+
+        if (in && in_locked)
+            in_preroll_start(in);
     }
 
     if (!modeNeedsCPActive) {
@@ -2408,16 +3619,47 @@ static int adev_set_mic_mute(struct audio_hw_device *dev, bool state)
         in->sleep_req = false;
         adev_lock(adev);
 
-        // in call mute is handled by RIL
-        if (adev->mode != AUDIO_MODE_IN_CALL) {
-            do_in_standby(in);
+        /*
+         * in call mute is handled by RIL. Otherwise release the ADC: in_read()
+         * produces paced silence while muted and reopens the PCM on unmute.
+         */
+        if (state && adev->mode != AUDIO_MODE_IN_CALL) {
+            in_preroll_release(in);
+            if (!in->standby)
+                do_in_standby(in);
+            /* still the active input: unmute below restarts it */
+            adev->active_in = in;
+        }
+
+        /* an idle voice recognition input gets its pre-roll back */
+        if (!state && !in->muted) {
+            adev->mic_mute = false;
+            adev_update_capture_blocked(adev);
+            in_preroll_start(in);
         }
 
         adev_unlock(adev);
+
+        /*
+         * Unmute restarts the PCM right away, so the first live in_read()
+         * does not pay for pcm_open() on top of its period.
+         */
+        if (!state && in->muted && in->standby && adev->mode != AUDIO_MODE_IN_CALL) {
+            adev_lock(adev);
+            adev->mic_mute = false;
+            adev_update_capture_blocked(adev);
+            adev_unlock(adev);
+            if (in_exit_standby(in) != 0)
+                ALOGE("adev_set_mic_mute() cannot restart capture, in_read() will retry");
+        }
+
         in_unlock(in);
     }
 
+    adev_lock(adev);
     adev->mic_mute = state;
+    adev_update_capture_blocked(adev);
+    adev_unlock(adev);
 
     return 0;
 }
@@ -2434,6 +3676,8 @@ static int adev_get_mic_mute(const struct audio_hw_device *dev, bool *state)
 static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
                                          const struct audio_config *config)
 {
+    struct audio_device *adev = (struct audio_device *)dev;
+    struct pcm_config *pcm_config = &adev->profiles[ROUTE_PROFILE_SPEAKER].in;
     size_t size;
 
     /*
@@ -2441,7 +3685,7 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
      * multiple of 16 frames, as audioflinger expects audio buffers to
      * be a multiple of 16 frames
      */
-    size = (pcm_config_in.period_size * config->sample_rate) / pcm_config_in.rate;
+    size = (pcm_config->period_size * config->sample_rate) / pcm_config->rate;
     size = ((size + 15) / 16) * 16;
 
     return (size * audio_channel_count_from_in_mask(config->channel_mask) *
@@ -2455,7 +3699,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
                                   struct audio_stream_in **stream_in,
                                   audio_input_flags_t flags __unused,
                                   const char *address __unused,
-                                  audio_source_t source __unused)
+                                  audio_source_t source)
 {
     struct audio_device *adev = (struct audio_device *)dev;
     struct stream_in *in;
@@ -2498,10 +3742,15 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->standby = true;
     in->requested_rate = config->sample_rate;
     /* default PCM config */
-    in->pcm_config = (config->sample_rate == IN_SAMPLING_RATE) && (flags & AUDIO_INPUT_FLAG_FAST) ?
-            &pcm_config_in_low_latency : &pcm_config_in;
+    in->low_latency = (config->sample_rate == IN_SAMPLING_RATE) && (flags & AUDIO_INPUT_FLAG_FAST);
+    in->pcm_config = in_select_config(in);
     // in->frames_read = 0;
 
+    in->source = source;
+    in->preroll_ms = property_get_int32(VR_PREROLL_PROPERTY, 0);
+    if (in->preroll_ms > VR_PREROLL_MAX_MS)
+        in->preroll_ms = VR_PREROLL_MAX_MS;
+
     ALOGD("adev_open_input_stream() done");
 
     *stream_in = &in->stream;
@@ -2513,14 +3762,21 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 {
     struct audio_device *adev = (struct audio_device *)dev;
 
+    struct stream_in *in = (struct stream_in *)stream;
+
     ALOGD("adev_close_input_stream()");
 
+    /* no pre-roll once the client is gone */
+    in->preroll_ms = 0;
     in_standby(&stream->common);
 
     adev_lock(adev);
+    in_preroll_release(in);
+    free(in->preroll_buf);
+    if (adev->active_in == in)
+        adev->active_in = NULL;
     free(stream);
     ALOGD("adev_close_input_stream() done %x", (unsigned int)adev->active_in);
-    adev->active_in = NULL;
     adev_unlock(adev);
 }
 
@@ -2586,11 +3842,14 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->in_source = AUDIO_DEVICE_NONE;
     adev->mode = AUDIO_MODE_NORMAL;
 
+    load_route_profiles(adev);
+
     *device = &adev->hw_device.common;
 
     /* RIL */
     loadRILD();
     adev->voice_volume = 1.0f;
+    adev->master_volume = 1.0f;
 
     mixer = open_mixer();
     select_devices(adev, mixer);
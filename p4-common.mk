@@ -110,6 +110,7 @@ PRODUCT_PACKAGES += \
 # Audio
 PRODUCT_PACKAGES += \
     audio.primary.tegra \
+    libspeakereq \
     audio.a2dp.default \
     audio.usb.default \
     audio.r_submix.default